@@ -0,0 +1,22 @@
+#
+#	esh-ready.bash -- skip what esh already did (bash)
+#
+#	Source this at the top of ~/.bash_profile (or ~/.profile) and guard
+#	the parts that only set up the environment, e.g.
+#
+#	    . /usr/local/share/esh/esh-ready.bash
+#	    if ! esh_ready; then
+#	        PATH=...
+#	    fi
+#
+#	or just "esh_ready && return" if that's all there is.  esh_ready is
+#	true only in the very shell that esh started with ESH_HANDSHAKE set,
+#	not in its subshells or anything else that inherits ESH_ENV_READY.
+#
+
+esh_ready() {
+    case ${ESH_ENV_READY-} in
+      $$) return 0 ;;
+      *) return 1 ;;
+    esac
+}
@@ -29,18 +29,24 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <ctype.h>
-#include <sys/file.h>
-#include <sys/utsname.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pwd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #ifdef DEBUGTIME
 #include <sys/types.h>
 #include <sys/timeb.h>
 #endif /* DEBUGTIME */
-#include <pwd.h>
 #include <sysexits.h>
-#include <sys/param.h>
 
-#define ESHVERSION	"2.1"
+#include "libesh.h"
+
+#define ESHVERSION	ESH_VERSION
 
 #define	SYSENVFILE	ETCDIR "/environ"
 #define USRENVFILE	"$HOME/.environ"
@@ -48,16 +54,31 @@
 #define SYSSHELL	"${SHELL-" DEFSHELL "}"
 #define USRSHELL	"$HOME/.shell"
 #define DEBUGFILE	"$HOME/.eshdebug"
-#define BIGBUFSIZ	8192
-#define ENVGROWTH	10
 #define REARGSIZ	64
-#define MAXKEYWORDS	64
 
 #define ESHFLAGS_VAR	"ESHFLAGS"
-#define AUTO_PRUNE_VAR	"ESH_AUTO_PRUNE_PATHS"
-#define RUN_COUNT_VAR	"ESH_RUN_COUNT"
+#define RUN_COUNT_VAR	ESH_RUN_COUNT
 #define MAX_COUNT_VAR	"ESH_MAX_COUNT"
 #define MAX_COUNT_DEF	99
+#define HOT_VARS	"PATH HOME LANG LC_* TERM LD_LIBRARY_PATH"
+#define HOT_VARS_VAR	"ESH_HOT_VARS"
+#define BUDGET_VAR	"ESH_ENV_BUDGET"
+#define HANDSHAKE_VAR	"ESH_HANDSHAKE"
+#define READY_VAR	"ESH_ENV_READY"
+#define SHELL_FLAGS_VAR	"ESH_SHELL_FLAGS"
+#define DEFERRED_VAR	"ESH_DEFERRED"
+#define DEFERRED_FILE	"${XDG_RUNTIME_DIR-/tmp}/esh-deferred"
+/* Leaves $? alone for whatever prompt code comes after it */
+#define DEFERRED_HOOK	"__esh_s=$?; [ -O \"$" DEFERRED_VAR "\" ] && " \
+			". \"$" DEFERRED_VAR "\"; (exit $__esh_s)"
+/* The hook gets rid of itself once it has run */
+#define DEFERRED_UNHOOK	"if [ -n \"$ZSH_VERSION\" ]; then " \
+			"eval 'precmd_functions=(${precmd_functions:#__esh_deferred})'; " \
+			"else PROMPT_COMMAND=${PROMPT_COMMAND/'" DEFERRED_HOOK "'/}; fi"
+#define REPORT_TOP	5
+#define STATS_FILE	RUNDIR "/stats"
+#define STATS_SLOTS	4096
+#define STATS_MAGIC	0x65736832	/* "esh2" */
 
 #define FALSE		0
 #define TRUE		(!FALSE)
@@ -68,48 +89,65 @@ enum {
     CSH_FORMAT,
     LISP_FORMAT,
     TEXT_FORMAT,
-    ZSH_FORMAT = SH_FORMAT,
+    GENERATOR_FORMAT,
+    ZSH_FORMAT,
 };
 
-enum editop {
-    OP_KEYWORD,
-    OP_DEFAULT,
-    OP_REPLACE,
-    OP_REMOVE,
-    OP_APPEND,
+/* What the time of a run is split up into */
+enum {
+    PHASE_SETUP,
+    PHASE_ENVIRON,
+    PHASE_SHELL,
+    PHASE_FINISH,
+    NPHASES
 };
 
+const char *const PhaseNames[NPHASES] = {"setup", "environ", "shell", "finish"};
+
+/* The kind of session, for the stats */
+#define SESSION_INTERACTIVE	0x01
+#define SESSION_LOGIN		0x02
+#define SESSION_COMMAND		0x04
+#define SESSION_GENERATOR	0x08
+
 extern char **environ;
 
-char *readbinding(FILE *), *interpret(const char *, int), *newstr(const char *);
-char **bassoc(const char *, char **), *mkbind(const char *, const char *);
-void readenv(const char *), fprintq(FILE *, const char *),
-    tilde(char **, char **, int);
-void expand(char **, char **, int), compute(char **, char **, int);
-void init_keywords(void), list_keywords(void), add_keyword(const char *);
+char *interpret(const char *), *newstr(const char *);
+void check(int), session_keywords(int, char **, int);
+void handshake(void), defer(void), sweep_deferred(const char *),
+     setdeferred(const char *);
+char **shellflags(char **, const char *);
+void optimize(void), report(char **);
+void phase(int), record_stats(void), print_stats(void);
+void fprintq(FILE *, const char *);
 void *xalloc(void *mem, long siz);
-void editenv(enum editop op, const char *binding);
 
-char **EnvBuf = NULL;
-int EnvSiz = 0;
+struct esh *E;			/* where the environment is built */
 
 int Debug = FALSE; /* TRUE; */
 char *SysEnvFile = SYSENVFILE;
 char *UsrEnvFile = USRENVFILE;
 char *Shell = NULL;
 int ShellOut = NO_FORMAT;
-int AutoPrunePaths = FALSE;
 int ResetOldEnvironment = FALSE;
 int ForceNewEnvironment = FALSE;
+int OptimizeLayout = FALSE;
+int ReportSize = FALSE;
+int ExecCommand = FALSE;
+int Deferred = FALSE;
+int SessionFlags = 0;
+unsigned int PhaseUsecs[NPHASES];
 
 void
 usage(int code, const char *name)
 {
-    fprintf(stderr, "usage: %s {-H | -K | -V}\n", name);
+    fprintf(stderr, "usage: %s {-H | -K | -V | --stats}\n", name);
+    fprintf(stderr, "       %s [-D] [-E sysenv] [-F usrenv] [-R] "
+	    "{-B | -C | -G | -I | -T | -Z}\n", name);
     fprintf(stderr, "       %s [-D] [-E sysenv] [-F usrenv] "
-	    "{-B | -C | -I | -T | -Z}\n", name);
+	    "[-L | -N] [-O] [-U] [-S shell] [shell-args ...]\n", name);
     fprintf(stderr, "       %s [-D] [-E sysenv] [-F usrenv] "
-	    "[-L | -N] [-S shell] [shell-args ...]\n", name);
+	    "[-N] [-O] [-R] [-U] --exec [--] command [args ...]\n", name);
     fprintf(stderr, "\n"
             "where:\n"
             //"  -A args   break up the <args> string and pass it to the shell\n"
@@ -120,19 +158,24 @@ usage(int code, const char *name)
 	    "            (default: " SYSENVFILE ")\n"
             "  -F file   read the user's environment from <file>\n"
 	    "            (default: " USRENVFILE ")\n"
+	    "  -G        print out bindings for a systemd environment generator\n"
             "  -H        print this usage help\n"
             "  -I        print out bindings in GNU Emacs LISP format\n"
             "  -K        list all automatically enabled keywords\n"
             "  -L        pretend to be a login shell\n"
             "  -N        force a new environment even if esh already has run\n"
+            "  -O        optimize the layout of the environment for the shell\n"
             "  -P        automatically prune paths by removing duplicates\n"
 	    "  -R        reset by suppressing inherited environment\n"
             "  -S shell  execute <shell> after setting up the environment\n"
 	    "            (default: ~/.shell or $SHELL)\n"
             "  -T        print out bindings in plain text format\n"
+            "  -U        report the size of the environment per variable\n"
 	    "  -X        pretend to be a normal (non-login) shell\n"
             "  -V        print out the current version number\n"
 	    "  -Z        print out bindings in zsh format\n"
+	    "  --exec    execute <command> directly instead of a shell\n"
+	    "  --stats   summarize the time taken by recent runs\n"
 	    );
 
     exit(code);
@@ -183,6 +226,51 @@ char *argopt(int argc, char **argv, int *pargi)
     return argv[*pargi];
 }
 
+void list_keywords(void)
+{
+    char **kk;
+
+    for (kk = esh_keywords(E); *kk != NULL; kk++) {
+	printf("%s\n", *kk);
+    }
+}
+
+/*
+ *	Add keywords that tell what kind of session this is: a "login" or
+ *	not, running a "command" (as with scp, rsync, and "ssh host cmd"),
+ *	a systemd "generator", and "interactive" or "noninteractive".
+ */
+void session_keywords(int argc, char **argv, int argi)
+{
+    int command = ExecCommand;
+
+    if (ShellOut == GENERATOR_FORMAT) {
+	check(esh_keyword(E, "generator"));
+	check(esh_keyword(E, "noninteractive"));
+	SessionFlags |= SESSION_GENERATOR;
+	return;
+    }
+
+    for (; !command && argi < argc && argv[argi][0] == '-'; argi++)
+	if (argv[argi][1] != '-' && strchr(argv[argi], 'c') != NULL)
+	    command = TRUE;
+
+    if (argv[0][0] == '-') {
+	check(esh_keyword(E, "login"));
+	SessionFlags |= SESSION_LOGIN;
+    }
+    if (command) {
+	check(esh_keyword(E, "command"));
+	SessionFlags |= SESSION_COMMAND;
+    }
+
+    if (!command && isatty(0) && isatty(2)) {
+	check(esh_keyword(E, "interactive"));
+	SessionFlags |= SESSION_INTERACTIVE;
+    } else
+	check(esh_keyword(E, "noninteractive"));
+}
+
 void printversion(void)
 {
     printf("esh version: " ESHVERSION "\n");
@@ -204,24 +292,31 @@ int procargs(int argc, char **argv)
 	    return argi;
 	} else if (strcmp(opt, "--help") == 0) {
 	    usage(EX_OK, argv[0]);
+	} else if (strcmp(opt, "--stats") == 0) {
+	    print_stats();
+	} else if (strcmp(opt, "--exec") == 0) {
+	    ExecCommand = TRUE;
 	} else {
 	    for (opt++; *opt != '\0'; opt++) {
 		switch (*opt) {
 		    //case 'A': rearg(&argc, &argv, &argi); break;
 		  case 'B': ShellOut = SH_FORMAT; break;
 		  case 'C': ShellOut = CSH_FORMAT; break;
-		  case 'D': Debug = !Debug; break;
+		  case 'D': Debug = !Debug; esh_setlog(E, stderr, Debug); break;
 		  case 'E': SysEnvFile = argopt(argc, argv, &argi); break;
 		  case 'F': UsrEnvFile = argopt(argc, argv, &argi); break;
+		  case 'G': ShellOut = GENERATOR_FORMAT; break;
 		  case 'H': usage(0, argv[0]); break;
 		  case 'I': ShellOut = LISP_FORMAT; break;
 		  case 'K': list_keywords(); exit(0); break;
 		  case 'L': argv[0][0] = '-'; break;
 		  case 'N': ForceNewEnvironment = TRUE; break;
-		  case 'P': AutoPrunePaths = TRUE; break;
+		  case 'O': OptimizeLayout = TRUE; break;
+		  case 'P': esh_setprune(E, TRUE); break;
 		  case 'R': ResetOldEnvironment = TRUE; break;
 		  case 'S': Shell = argopt(argc, argv, &argi); break;
 		  case 'T': ShellOut = TEXT_FORMAT; break;
+		  case 'U': ReportSize = TRUE; break;
 		  case 'V': printversion(); exit(0); break;
 		  case 'X': if (argv[0][0] == '-') argv[0][0] = 'x'; break;
 		  case 'Z': ShellOut = ZSH_FORMAT; break;
@@ -244,6 +339,7 @@ printenv(char *var, char *val)
 {
     switch (ShellOut) {
       case SH_FORMAT:
+      case ZSH_FORMAT:
 	printf("export %s=", var);
 	if (val != NULL) {
 	    fprintq(stdout, val);
@@ -276,6 +372,15 @@ printenv(char *var, char *val)
 	}
 	putchar('\n');
 	break;
+
+      case GENERATOR_FORMAT:
+	/* There's no way to unset anything */
+	if (val != NULL) {
+	    printf("%s=", var);
+	    fprintq(stdout, val);
+	    putchar('\n');
+	}
+	break;
     }
 }
 
@@ -292,13 +397,28 @@ main(int argc, char **argv)
     (void) ftime(&before);
 #endif /* DEBUGTIME */
 
-    p = interpret(DEBUGFILE, FALSE);
-    if (p != NULL && access(p, F_OK) == 0)
+    phase(PHASE_SETUP);
+    if ((E = esh_new(NULL, NULL)) == NULL) {
+	perror(argv[0]);
+	exit(1);
+    }
+    check(esh_inherit(E, oldenv));
+
+    p = interpret(DEBUGFILE);
+    if (p != NULL && esh_access(E, p, F_OK) == 0)
 	Debug = TRUE;
+    esh_setlog(E, stderr, Debug);
+
+    check(esh_init_keywords(E, NULL));
 
-    init_keywords();
+    /* Linked into user-environment-generators/, which passes no options */
+    if (strstr(argv[0], "environment-generators/") != NULL)
+	ShellOut = GENERATOR_FORMAT;
 
     argi = procargs(argc, argv);
+    if (ExecCommand && argi >= argc)
+	usage(EX_USAGE, argv[0]);
+    session_keywords(argc, argv, argi);
 
     if (Debug) {
 	int a;
@@ -311,22 +431,21 @@ main(int argc, char **argv)
 	fprintf(stderr, "\n");
     }
 
+    phase(PHASE_ENVIRON);
     int run_count = 0;
     int max_count = MAX_COUNT_DEF;
 
-    /* copy old environment into a large enough buffer and replace it
-     * all while looking out for a recursive application of ourselves
-     */
+    /* look out for a recursive application of ourselves */
     for (ee = oldenv; *ee != NULL; ee++) {
-	if (strncmp(*ee, RUN_COUNT_VAR "=", sizeof(RUN_COUNT_VAR)) == 0) {
+	if (strncmp(*ee, RUN_COUNT_VAR "=", sizeof(RUN_COUNT_VAR)) == 0)
 	    run_count = atoi(*ee + sizeof(RUN_COUNT_VAR));
-	} else {
-	    if (strncmp(*ee, MAX_COUNT_VAR "=", sizeof(MAX_COUNT_VAR)) == 0)
-		max_count = atoi(*ee + sizeof(MAX_COUNT_VAR));
-	    if (!ResetOldEnvironment)
-		editenv(OP_APPEND, *ee);
-	}
+	else if (strncmp(*ee, MAX_COUNT_VAR "=", sizeof(MAX_COUNT_VAR)) == 0)
+	    max_count = atoi(*ee + sizeof(MAX_COUNT_VAR));
     }
+    if (ResetOldEnvironment)
+	check(esh_inherit(E, NULL));
+    else
+	check(esh_unsetenv(E, RUN_COUNT_VAR));
 
     /* Check for possibly infinite recursion (or at least enough recursive
      * applications to be suspicious).
@@ -339,27 +458,20 @@ main(int argc, char **argv)
 		argv[0], argv[0], DEFSHELL);
 	execv(DEFSHELL, argv);
     } else {
-	char tmpbuf[sizeof(RUN_COUNT_VAR) + 32];
-	snprintf(tmpbuf, sizeof(tmpbuf), "%s=%d", RUN_COUNT_VAR, run_count + 1);
-	editenv(OP_APPEND, strdup(tmpbuf));
+	char tmpbuf[32];
+	snprintf(tmpbuf, sizeof(tmpbuf), "%d", run_count + 1);
+	check(esh_setenv(E, RUN_COUNT_VAR, tmpbuf));
     }
 
     /* Avoid re-interpreting the environment if it already has been set up
      * (unless we're forced to do it anyway).
      */
     if (run_count == 0 || ForceNewEnvironment) {
-	/* add global environment */
-	if (Debug)
-	    fprintf(stderr, "[--system environment--]\n");
-	readenv(interpret(SysEnvFile, FALSE));
-
-	/* add private environment */
-	if (Debug)
-	    fprintf(stderr, "[--user environment--]\n");
-	readenv(interpret(UsrEnvFile, FALSE));
+	check(esh_loadenv(E, SysEnvFile, UsrEnvFile,
+			  ResetOldEnvironment ? NULL : oldenv));
 
 	/* reinterpret args in the environment (if any) */
-	envflags = interpret(getenv(ESHFLAGS_VAR), FALSE);
+	envflags = interpret(esh_getenv(E, ESHFLAGS_VAR));
 	if (envflags != NULL) {
 	    char *xargs[] = {argv[0], envflags, NULL};
 	    char **xargv = xargs;
@@ -375,15 +487,21 @@ main(int argc, char **argv)
      * If the shell hasn't been given (normal case),
      * check ~/.shell to see what it should be.
      */
-    if (Shell == NULL) {
-	Shell = interpret(USRSHELL, FALSE);
-
-	if (access(Shell, F_OK) < 0)
-	    Shell = interpret(SYSSHELL, FALSE);
-
-	if (access(Shell, X_OK) < 0) {
+    phase(PHASE_SHELL);
+    if (ExecCommand || ShellOut == GENERATOR_FORMAT) {
+	/* Not going anywhere near a shell */
+	check(esh_snapshot_save(E, NULL));
+    } else if (Shell == NULL && esh_snapshot_shell(E) != NULL) {
+	Shell = esh_snapshot_shell(E);
+    } else if (Shell == NULL) {
+	Shell = interpret(USRSHELL);
+
+	if (esh_access(E, Shell, F_OK) < 0)
+	    Shell = interpret(SYSSHELL);
+
+	if (esh_access(E, Shell, X_OK) < 0) {
 	    /* not executable, assume text file with name of shell */
-	    FILE *stream = fopen(Shell, "r");
+	    FILE *stream = esh_fopen(E, Shell);
 
 	    if (stream == NULL) {
 		perror(Shell);
@@ -398,16 +516,37 @@ main(int argc, char **argv)
 	    if ((p = strchr(buf, '\n')) != NULL)
 		*p = '\0';
 
-	    Shell = interpret(buf, FALSE);
+	    Shell = interpret(buf);
 	    (void) fclose(stream);
 	}
+
+	Shell = newstr(Shell);
+	check(esh_snapshot_save(E, Shell));
+    } else {
+	check(esh_snapshot_save(E, NULL));
     }
 
+    phase(PHASE_FINISH);
+
     /* remove our internal temporary '_' variable */
-    editenv(OP_REMOVE, "_");
+    check(esh_unsetenv(E, "_"));
 
     /* rebind SHELL to point to the user-specified shell */
-    editenv(OP_REPLACE, mkbind("SHELL", Shell));
+    if (Shell != NULL)
+	check(esh_setenv(E, "SHELL", Shell));
+
+    /* let the shell know that it doesn't have to set up all this again */
+    if (ShellOut == NO_FORMAT && !ExecCommand)
+	handshake();
+
+    /* leave the "&name value" bindings for later, if we can */
+    defer();
+
+    /* The shell has its own idea of how to lay out what we print */
+    if (OptimizeLayout && ShellOut == NO_FORMAT)
+	optimize();
+    environ = esh_environ(E);
+    report(environ);
 
     /*
      *  Only do shell source output?
@@ -436,9 +575,37 @@ main(int argc, char **argv)
 	if (ShellOut == LISP_FORMAT)
 	    printf(")\n");
 
+	/* pick up the deferred bindings at the first prompt they're ready */
+	if (Deferred && ShellOut == SH_FORMAT)
+	    printf("PROMPT_COMMAND=\"${PROMPT_COMMAND:+$PROMPT_COMMAND\n}\"'%s'\n",
+		   DEFERRED_HOOK);
+	else if (Deferred && ShellOut == ZSH_FORMAT)
+	    printf("__esh_deferred() { %s; }; "
+		   "precmd_functions+=(__esh_deferred)\n", DEFERRED_HOOK);
+
+	record_stats();
 	exit(0);
     }
 
+    /*
+     * Run the command as is, looking it up in the new PATH.
+     */
+    if (ExecCommand) {
+	args = &argv[argi];
+	if (Debug) {
+	    char **pp;
+	    fprintf(stderr, "[exec");
+	    for (pp = args; *pp != NULL; pp++)
+		fprintf(stderr, " %s", *pp);
+	    fprintf(stderr, "]\n");
+	}
+	record_stats();
+	execvp(args[0], args);
+	argi = errno;
+	perror(args[0]);
+	exit(argi == ENOENT ? 127 : 126);
+    }
+
     /*
      * Set up args for exec'ing the new shell and replace args[0]
      * with a leading dash (if we're a login shell) and the name of the shell.
@@ -449,10 +616,11 @@ main(int argc, char **argv)
     /*
      * Hack Attack!  If the file begins with a dot (like .shell) and it is
      * a symlink, then replace it with the target file so that the shell
-     * won't get confused about what it is
+     * won't get confused about what it is (and exec the target directly,
+     * if we can, rather than going through the home directory again).
      */
     if (p[0] == '.' || (p[0] == '/' && p[1] == '.')) {
-	int len = readlink(Shell, buf, sizeof(buf));
+	int len = esh_readlink(E, Shell, buf, sizeof(buf));
 
 	if (len >= 0) {
 	    if (len == sizeof(buf))
@@ -460,6 +628,8 @@ main(int argc, char **argv)
 	    buf[len] = '\0';
 	    if ((p = strrchr(buf, '/')) == NULL)
 		p = buf;
+	    if (buf[0] == '/')
+		Shell = newstr(buf);
 	}
     }
     if (argv[0][0] == '-') {
@@ -469,6 +639,7 @@ main(int argc, char **argv)
 	args[0] = newstr(p);
     else
 	args[0] = newstr(p + 1);
+    args = shellflags(args, *p == '/' ? p + 1 : p);
 
     /* the shell is dead, long live the shell! */
     if (Debug) {
@@ -484,6 +655,7 @@ main(int argc, char **argv)
 	    (after.time + after.millitm * 0.001) -
 	    (before.time + before.millitm * 0.001));
 #endif /* DEBUGTIME */
+    record_stats();
     execvp(Shell, args);
     perror(Shell);
     execve("/bin/sh", args, environ);
@@ -491,860 +663,564 @@ main(int argc, char **argv)
     exit(1);
 }
 
+/*
+ *	Print and automatically quote a string (sh/csh syntax).
+ */
 void
-readenv(const char *file)
+fprintq(FILE *stream, const char *string)
 {
-    FILE *stream;
-    char *binding;
-#ifdef DISABLE_NONINTERACTIVE_PS1
-    int interactive = isatty(0);
-#endif
-
-    if (file == NULL)
-	return;
-
-    if (strcmp(file, "-") == 0)
-	stream = stdin;
-    else {
-	stream = fopen(file, "r");
-	if (stream == NULL)
-	    return;
-    }
-
-    while ((binding = readbinding(stream)) != NULL) {
-	enum editop op = OP_REPLACE;
-
-	if (Debug)
-	    fprintf(stderr, "[%s]\n", binding);
+    const char *p;
 
-#ifdef DISABLE_NONINTERACTIVE_PS1
-	if (!interactive && strncmp(binding, "PS1=", 4) == 0)
-	    op = OP_REMOVE;
-#endif
+    if (ShellOut == LISP_FORMAT) {
+	putc('"', stream);
+	for (p = string; *p != '\0'; p++) {
+	    if (*p == '"' || *p == '\\')
+		putc('\\', stream);
+	    putc(*p, stream);
+	}
+	putc('"', stream);
 
-	switch (*binding) {
-	  case '=':
-	    op = OP_KEYWORD;
-	    binding++;
-	    break;
-	  case '\\':
-	    binding++;
-	    break;
-	  case '-':
-	    op = OP_REMOVE;
-	    binding++;
-	    break;
-	  case '?':
-	    op = OP_DEFAULT;
-	    binding++;
-	    break;
+    } else if (ShellOut == GENERATOR_FORMAT) {
+	/* As systemd reads environment files */
+	putc('"', stream);
+	for (p = string; *p != '\0'; p++) {
+	    if (strchr("\"\\`$", *p) != NULL)
+		putc('\\', stream);
+	    putc(*p, stream);
 	}
+	putc('"', stream);
 
-	if (op == OP_KEYWORD)
-	    add_keyword(binding);
-	else
-	    editenv(op, binding);
+    } else {
+	putc('\'', stream);
+	for (p = string; *p != '\0'; p++)
+	    if (*p == '\'')
+		fputs("'\"'\"'", stream);
+	    else
+		putc(*p, stream);
+	putc('\'', stream);
     }
-
-    if (stream != stdin)
-	(void) fclose(stream);
-    return;
 }
 
 /*
- *	Make a freshly malloc'ed environment variable binding.
- *	mkbind("foo", "bar") => "foo=bar"
+ *	If ESH_HANDSHAKE is set, export ESH_ENV_READY as the pid of the shell
+ *	that we are about to become.  The esh-ready snippets check it, so
+ *	that only that shell (and not its subshells, or anything else that
+ *	inherits it) skips what its rc files would redo.
  */
-char *
-mkbind(const char *name, const char *value)
+void
+handshake(void)
 {
-    char *buf = xalloc(NULL, strlen(name) + 1 + strlen(value) + 1);
+    char *p, buf[32];
 
-    sprintf(buf, "%s=%s", name, value);
+    p = esh_getenv(E, HANDSHAKE_VAR);
+    if (p == NULL || *p == '\0')
+	return;
 
-    return buf;
+    snprintf(buf, sizeof(buf), "%d", (int) getpid());
+    check(esh_setenv(E, READY_VAR, buf));
 }
 
 /*
- *	Keyword processing (aka conditional).
- */
-
-static char *keywords[MAXKEYWORDS] = {
-    /* these will always match */
-    "all",
-
-    /* operating systems */
-#ifdef __AIX
-    "aix",
-#endif
-#ifdef __ANDROID__
-    "android",
-#endif
-#ifdef __APPLE__
-    "apple",
-#include <TargetConditionals.h>
-#if TARGET_OS_IPHONE || TARGET_IPHONE_SIMULATOR
-    "iphone",
-    "ios",
-#elif TARGET_OS_MAC
-    "osx",
-    "macos",
-#endif // !TARGET_OS_MAC
-#endif // __APPLE_
-#ifdef DARWIN
-    "darwin",
-#endif
-#ifdef __hpux
-    "hp-ux",
-#endif
-#ifdef __linux__
-    "linux",
-#endif
-#ifdef __MACH__
-    "mach",
-#endif
-#ifdef __sun
-#ifdef __SVR4
-    "solaris",
-#else
-    "sunos",
-#endif // !__SVR4
-#endif // __sun
-#ifdef __unix__
-    "unix",
-#ifdef BSD
-    "bsd",
-#endif // BSD
-#endif
-#ifdef _WIN32
-    "win32",
-    "windows",
-#elif defined(_WIN64)
-    "win64",
-    "windows",
-#endif
-
-	/* architectures */
-#ifdef __i386__
-    "i386",
-#endif
-#ifdef __i486__
-    "i486",
-#endif
-#ifdef __i586__
-    "i586",
-#endif
-#ifdef __i686__
-    "i686",
-#endif
-#if defined(__i386__) || defined(__i486__) || defined(__i586__) || defined (__i686__)
-    "ixxx",
-    "intel",
-#endif
-#if defined(__ppc__) || defined(__POWERPC__) || defined(_ARCH_PPC)
-    "ppc",
-    "powerpc",
-#endif
-#if defined(__arm__)
-    "arm",
-#endif
-
-    NULL
-};
-
-/*
- *	Add a new word to the list of known keywords.
+ *	Add the flags that ESH_SHELL_FLAGS gives for the named shell, as in
+ *	"bash:--noprofile zsh:--no-globalrcs", right after args[0].
  */
-void add_keyword(const char *word)
+char **
+shellflags(char **args, const char *name)
 {
-    char **kk;
-
-    /* Don't add NULL words */
-    if (word == NULL || *word == '\0')
-	return;
-
-    if (Debug)
-	fprintf(stderr, "# Adding keyword \"%s\"\n", word);
-
-    /* Check if we might already got it */
-    for (kk = keywords; *kk != NULL; kk++)
-	if (strcasecmp(*kk, word) == 0)
-	    return;
+    char *flags = esh_getenv(E, SHELL_FLAGS_VAR);
+    char **nargs, *word;
+    int len = strlen(name), n, i;
+
+    if (flags == NULL || *flags == '\0')
+	return args;
+
+    for (n = 0; args[n] != NULL; n++);
+    nargs = xalloc(NULL, (n + strlen(flags) / 2 + 2) * sizeof(char *));
+    nargs[0] = args[0];
+
+    for (i = 1, word = strtok(newstr(flags), " \t"); word != NULL;
+	 word = strtok(NULL, " \t")) {
+	if (strncmp(word, name, len) == 0 && word[len] == ':' &&
+	    word[len + 1] != '\0')
+	    nargs[i++] = word + len + 1;
+    }
+    memcpy(&nargs[i], &args[1], n * sizeof(char *));
 
-    *kk = xalloc(NULL, strlen(word) + 1);
-    strcpy(*kk, word);
-    *++kk = NULL;
+    return nargs;
 }
 
 /*
- *	Add qualified & unqualified hostname + all parent domains too.
- *
- *	Warning: Will trash hostname in the process.
+ *	Remove the deferred files (named prefix.<uid>.<pid>) of our own that
+ *	were left behind by shells that are gone without sourcing them.
  */
-void add_keyword_hostname(char *hostname)
+void
+sweep_deferred(const char *prefix)
 {
-    char *p, *q;
-
-    add_keyword(hostname);
-
-    p = strchr(hostname, '.');
-    if (p != NULL) {
-	*p++ = '\0';
-	add_keyword(hostname);
-	while ((q = strchr(p, '.')) != NULL) {
-	    add_keyword(p);
-	    *q++ = '\0';
-	    p = q;
-	}
+    const char *base = strrchr(prefix, '/');
+    char *dir, *path, *end;
+    struct dirent *de;
+    struct stat st;
+    size_t len;
+    long pid;
+    DIR *dd;
+
+    if (base == NULL)
+	return;
+    dir = newstr(prefix);
+    dir[base++ - prefix] = '\0';
+    if ((dd = opendir(*dir != '\0' ? dir : "/")) == NULL) {
+	free(dir);
+	return;
     }
+
+    len = strlen(base);
+    path = xalloc(NULL, strlen(dir) + NAME_MAX + 2);
+    while ((de = readdir(dd)) != NULL) {
+	if (strncmp(de->d_name, base, len) != 0 || de->d_name[len] != '.' ||
+	    strtoul(de->d_name + len + 1, &end, 10) != getuid() ||
+	    *end != '.' || (pid = strtol(end + 1, &end, 10)) <= 0 ||
+	    (*end != '\0' && strcmp(end, ".tmp") != 0) ||
+	    kill((pid_t) pid, 0) == 0 || errno != ESRCH)
+	    continue;
+	sprintf(path, "%s/%s", dir, de->d_name);
+	if (lstat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+	    st.st_uid == getuid())
+	    (void) unlink(path);
+    }
+    (void) closedir(dd);
+    free(path);
+    free(dir);
 }
 
 /*
- *	Fill up the keywords array with more words that apply to us.
+ *	Evaluate the "&name value" bindings.  If an interactive shell is
+ *	going to be able to pick them up from a prompt hook, this is done
+ *	by a detached child that writes them to the ESH_DEFERRED file (and
+ *	removes it again when sourced), so that the shell doesn't have to
+ *	wait for them; otherwise, they are evaluated right away.
  */
-void init_keywords(void)
+void
+defer(void)
 {
-    struct utsname uts;
-    struct passwd *pw = getpwuid(getuid());
-    char hostbuf[1024];
-
-    add_keyword(getlogin());
+    char **dd = esh_deferred(E);
+    char *file, *tmp, *shell, *p, buf[BUFSIZ];
+    int fd, len, status;
+    pid_t pid;
 
-    if (pw != NULL)
-	add_keyword(pw->pw_name);
+    if (*dd == NULL)
+	return;
+    sweep_deferred(interpret(DEFERRED_FILE));
 
-    if (gethostname(hostbuf, sizeof(hostbuf)) == 0)
-	add_keyword_hostname(hostbuf);
+    /* A bash that we exec takes its PROMPT_COMMAND from the environment */
+    shell = NULL;
+    if (ShellOut == NO_FORMAT && Shell != NULL) {
+	len = esh_readlink(E, Shell, buf, sizeof(buf) - 1);
+	if (len >= 0)
+	    buf[len] = '\0';
+	shell = strrchr(len >= 0 ? buf : Shell, '/');
+	shell = shell != NULL ? shell + 1 : len >= 0 ? buf : Shell;
+    }
 
-    if (uname(&uts) == 0) {
-	/* [<os>], e.g. [Linux] or [Darwin] */
-	add_keyword(uts.sysname);
+    if (!(SessionFlags & SESSION_INTERACTIVE) ||
+	(ShellOut != SH_FORMAT && ShellOut != ZSH_FORMAT &&
+	 (shell == NULL || strcmp(shell, "bash") != 0))) {
+	for (; *dd != NULL; dd++)
+	    setdeferred(*dd);
+	return;
+    }
 
-	/* [<nodename>], e.g. [lenux.lan.lovstrand.com] or [neo] */
-	add_keyword_hostname(uts.nodename);
+    p = interpret(DEFERRED_FILE);
+    file = xalloc(NULL, strlen(p) + 64);
+    sprintf(file, "%s.%d.%d", p, (int) getuid(), (int) getpid());
 
-	/* [<machine>], e.g. [i686] or [Power Macintosh] */
-	add_keyword(uts.machine);
+    /* Fork twice, so that the shell won't be left with a stray child */
+    fflush(NULL);
+    if ((pid = fork()) < 0) {
+	for (; *dd != NULL; dd++)
+	    setdeferred(*dd);
+	free(file);
+	return;
+    } else if (pid == 0) {
+	(void) setsid();
+	if (fork() != 0)
+	    _exit(0);
+
+	if ((fd = open("/dev/null", O_RDWR)) >= 0) {
+	    (void) dup2(fd, 0);
+	    (void) dup2(fd, 1);
+	    if (!Debug)
+		(void) dup2(fd, 2);
+	    if (fd > 2)
+		(void) close(fd);
+	}
+	for (; *dd != NULL; dd++)
+	    setdeferred(*dd);
+
+	/* Write it all to a temporary file first, then move it into place */
+	tmp = xalloc(NULL, strlen(file) + 5);
+	sprintf(tmp, "%s.tmp", file);
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0600)) < 0)
+	    _exit(1);
+	(void) dup2(fd, 1);
+	(void) close(fd);
+
+	ShellOut = SH_FORMAT;
+	for (dd = esh_deferred(E); *dd != NULL; dd++) {
+	    p = newstr(*dd);
+	    *strchr(p, '=') = '\0';
+	    printenv(p, esh_getenv(E, p));
+	    free(p);
+	}
+	printf("rm -f \"$%s\"; unset %s\n%s\n", DEFERRED_VAR, DEFERRED_VAR,
+	       DEFERRED_UNHOOK);
+	if (fflush(stdout) != 0 || rename(tmp, file) < 0) {
+	    (void) unlink(tmp);
+	    _exit(1);
+	}
+	_exit(0);
     }
-}
-
-void list_keywords(void)
-{
-    char **kk;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+	;
 
-    for (kk = keywords; *kk != NULL; kk++) {
-	printf("%s\n", *kk);
+    if (Debug)
+	fprintf(stderr, "[deferred to %s]\n", file);
+    check(esh_setenv(E, DEFERRED_VAR, file));
+    if (ShellOut == NO_FORMAT) {
+	p = esh_getenv(E, "PROMPT_COMMAND");
+	tmp = xalloc(NULL, sizeof(DEFERRED_HOOK) + 1 + (p != NULL ? strlen(p) : 0));
+	sprintf(tmp, "%s%s%s", p != NULL ? p : "",
+		p != NULL && *p != '\0' ? "\n" : "", DEFERRED_HOOK);
+	check(esh_setenv(E, "PROMPT_COMMAND", tmp));
+	free(tmp);
     }
+    Deferred = TRUE;
+    free(file);
 }
 
 /*
- *	Basic '*' and '?' pattern matching
+ *	Bind a deferred "name=value", with the value yet to be interpreted.
  */
-int matches(const char *pat, const char *str)
+void
+setdeferred(const char *binding)
 {
-    for (; *pat != '\0'; pat++) {
-	if (*pat == '*') {
-	    for (pat++;; str++) {
-		if (matches(pat, str))
-		    return TRUE;
-		if (*str == '\0')
-		    return FALSE;
-	    }
+    char *name = newstr(binding);
 
-	} else if (*pat == '?' && *str != '\0') {
-	    str++;
-
-	} else if (tolower(*pat) == tolower(*str)) {
-	    str++;
-
-	} else {
-	    return FALSE;
-	}
-    }
-
-    return *str == '\0';
+    *strchr(name, '=') = '\0';
+    check(esh_setenv(E, name, interpret(binding + strlen(name) + 1)));
+    free(name);
 }
 
 /*
- *	Determine if a certain "[name]" conditional applies to us.
+ *	Put the most frequently looked up variables first, followed by the
+ *	ones in ESH_HOT_VARS, and get rid of the empty ones.
  */
-int conditional(const char *name)
+void
+optimize(void)
 {
-    char **kk;
-
-    /* try all predefined keywords */
-    for (kk = keywords; *kk != NULL; kk++) {
-	if (matches(name, *kk))
-	    return TRUE;
-    }
+    const char *extra = esh_getenv(E, HOT_VARS_VAR);
+    char *hot = xalloc(NULL, sizeof(HOT_VARS) + 1 +
+		       (extra != NULL ? strlen(extra) : 0));
 
-    /* if all else fails... well, we fail too */
-    return FALSE;
+    sprintf(hot, "%s %s", HOT_VARS, extra != NULL ? extra : "");
+    check(esh_layout(E, hot));
+    free(hot);
 }
 
 int
-auto_prune_paths()
+cmpsize(const void *a, const void *b)
 {
-    return AutoPrunePaths || (getenv(AUTO_PRUNE_VAR) != NULL);
+    return strlen(*(char **) b) - strlen(*(char **) a);
 }
 
 /*
- *	Read a binding from the stream and return it in the form "name=value".
- *	The format of the file is: name<whitespace>value<newline> with
- *	special processing for #, $, \.
- *
- *	Example:
- *		" name [=] value\"
- *		"	\#value\$value # comment"
- *		=> "name=value#value$value"
+ *	Report the size of the environment (counted like execve() does) if
+ *	asked to, or if it exceeds ESH_ENV_BUDGET or ARG_MAX, along with the
+ *	biggest variables.
  */
-char *
-readbinding(FILE *stream)
+void
+report(char **env)
 {
-    char *p, *b, buf[BIGBUFSIZ];
-    char *name, *value;
-    int pathp = FALSE;
-    int ignore = FALSE;
-    int comment_level, new_comment_level = 0;
-    char in_quote = '\0';
-
-    name = value = NULL;
-    b = buf;
-    while (fgets(b, buf + sizeof(buf) - b, stream) != NULL) {
-	comment_level = new_comment_level;
-
-	/* find newline and nuke it */
-	p = strchr(b, '\n');
-	if (p == NULL)
-	    fprintf(stderr,
-		    "Warning: Line too long -- truncated after %d chars\n",
-		    (int) sizeof(buf)-1);
-	else
-	    *p = '\0';
-
-	/* find unquoted sharp (#) and nuke rest of line */
-	for (p = b; *p != '\0'; p++) {
-	    if (*p == '\\' && p[1] != '\0')
-		p++;
-	    else if (*p == in_quote)
-		in_quote = '\0';
-	    else if (in_quote == '\0') {
-		if (*p == '\'' || *p == '"')
-		    in_quote = *p;
-		else if (*p == '#') {
-		    if (p[1] == '<')
-			new_comment_level = comment_level + 1;
-		    else if (p[1] == '>')
-			new_comment_level = comment_level - 1;
-		    break;
-		}
-	    }
-	}
-
-	/* nuke all trailing spaces */
-	while (p > b && isspace(p[-1]) && (p == b + 1 || p[-2] != '\\'))
-	    p--;
-	*p = '\0';
-
-	/* are we in a #<...#> multiline block? */
-	if (comment_level > 0)
-	    continue;
-
-	p = b;
-	/* skip leading spaces */
-	while (*p != '\0' && isspace(*p))
-	    p++;
-	if (*p == '\0')
-	    continue;
-
-	/* Is it a conditional "[name]" section? */
-	if (*p == '[') {
-	    char *n, name[1024];
-	    char endexec = '\0';
-	    int inexec = FALSE;
-	    int intest = FALSE;
-	    int parens = 0;
-
-	    /* Scan forward looking for a possible trailing '_' binding */
-	    n = strrchr(p, ']');
-	    if (n != NULL) {
-		for (n++; *n != '\0' && isspace(*n); n++);
-		if (*n != '\0')
-		    editenv(OP_REPLACE, mkbind("_", interpret(n, FALSE)));
-	    }
-
-	    /* Assume that we will ignore this section */
-	    ignore = TRUE;
-
-	    for (n = name, p++; *p != '\0'; p++) {
-		if (!inexec && !intest && (isspace(*p) || *p == ']')) {
-		    /* Simple keyword, check if it's enabled */
-		    *n = '\0';
-		    if (ignore && n > name && conditional(name)) {
-			ignore = FALSE;
-			break;
-		    }
-		    n = name;
-
-		} else if (*p == endexec && parens == 0) {
-		    /* It's the end of a `...` or $(...) expression.
-		     * Send it to the shell and see what exit code we get.
-		     */
-		    *n = '\0';
-		    if (ignore && system(name) == 0) {
-			ignore = FALSE;
-			break;
-		    }
-		    n = name;
-		    inexec = FALSE;
-
-		} else if (!intest && *p == '[') {
-		    /* The start of a [...] test (q.v.) */
-		    intest = TRUE;
-		    *n++ = '[';
-		    *n++ = ' ';
-
-		} else if (intest && *p == ']') {
-		    /* The end of a [...] test */
-		    if (n < &name[sizeof(name)-2]) {
-			*n++ = ' ';
-			*n++ = ']';
-		    }
-		    *n = '\0';
-		    if (Debug)
-			fprintf(stderr, "# test: %s\n", name);
-		    if (ignore && system(name) == 0) {
-			ignore = FALSE;
-			break;
-		    }
-		    n = name;
-		    intest = FALSE;
-
-		} else if (!inexec && !intest && *p == '`') {
-		    /* The start of a `...` expression. */
-		    inexec = TRUE;
-		    endexec = *p;
-
-		} else if (!inexec && !intest && *p == '$' && p[1] == '(') {
-		    /* The start of a $(...) expression */
-		    p++;
-		    inexec = TRUE;
-		    endexec = ')';
-
-		} else if (n < &name[sizeof(name)-1]) {
-		    /* Inside of something, keep copying it to the name buf */
-		    *n++ = *p;
-
-		    if (inexec) {
-			if (*p == '(')
-			    parens++;
-			else if (*p == ')')
-			    parens--;
-		    }
-		}
-
-		if (*p == ']')
-		    break;
-	    }
-	    continue;
-	}
-
-	/* Ignore all bindings within a dissatisfied section */
-	if (ignore)
-	    continue;
-
-	/* got a name already? */
-	if (name == NULL) {
-	    /* find beginning of name */
-	    name = p;
-
-	    /* find end of name */
-	    while (*p != '\0' && !isspace(*p) && *p != '=')
-		p++;
-	    if (*p == '\0')
-		return mkbind(name, "");
-	    *p++ = '\0';
-
-	    /* is this a path variable? */
-	    if (auto_prune_paths() &&
-		p - 5 >= b && strncmp(p - 5, "PATH", 4) == 0)
-		pathp = TRUE;
-	    b = p;
-	}
+    const char *budvar = esh_getenv(E, BUDGET_VAR);
+    long budget = budvar != NULL ? atol(budvar) : 0;
+    long argmax = sysconf(_SC_ARG_MAX);
+    long total = sizeof(char *);
+    char **ee, **sorted;
+    int n, i, top;
+
+    for (n = 0; env[n] != NULL; n++)
+	total += strlen(env[n]) + 1 + sizeof(char *);
+
+    if (argmax > 0 && total > argmax)
+	fprintf(stderr, "esh: environment is %ld bytes, over ARG_MAX (%ld)\n",
+		total, argmax);
+    else if (budget > 0 && total > budget)
+	fprintf(stderr, "esh: environment is %ld bytes, over the %s of %ld\n",
+		total, BUDGET_VAR, budget);
+    else if (!ReportSize)
+	return;
 
-	/* find beginning of value */
-	while (*p != '\0' && isspace(*p))
-	    p++;
+    fprintf(stderr, "# %ld bytes in %d variables (ARG_MAX %ld, budget %ld)\n",
+	    total, n, argmax, budget);
 
-	/* compact buffer if necessary */
-	if (p > b) {
-	    memmove(b, p, strlen(p) + 1);
-	    p = b;
-	}
+    sorted = xalloc(NULL, (n + 1) * sizeof(char *));
+    memcpy(sorted, env, (n + 1) * sizeof(char *));
+    qsort(sorted, n, sizeof(char *), cmpsize);
 
-	if (value == NULL)
-	    value = p;
+    top = ReportSize ? n : (n < REPORT_TOP ? n : REPORT_TOP);
+    for (i = 0, ee = sorted; i < top; i++, ee++)
+	fprintf(stderr, "# %7ld %5.1f%% %.*s\n",
+		(long) strlen(*ee) + 1 + (long) sizeof(char *),
+		100.0 * (strlen(*ee) + 1 + sizeof(char *)) / total,
+		(int) strcspn(*ee, "="), *ee);
 
-	/* empty/end of value? */
-	if (*p == '\0')
-	    break;
-
-	/* check end of value */
-	p += strlen(p);
-	if (p == value || p[-1] != '\\')
-	    break;
-
-	/* handle continuation */
-	*--p = '\0';
-	b = p;
-    }
-
-    if (name == NULL)
-	return NULL;
+    free(sorted);
+}
 
-    if (pathp) {
-	extern char *ppath(const char *path);
-	char *bind;
+/*
+ *	Per-run statistics are appended as fixed size records to a file of
+ *	each user's own, STATS_FILE.<uid>, which that user's esh's can add to
+ *	at the same time without locking (appends of a single record being
+ *	atomic).  Once it holds twice STATS_SLOTS records it is renamed to
+ *	STATS_FILE.<uid>.old, so that at least the last STATS_SLOTS runs are
+ *	kept.  The records are only believed for the uid that owns the file,
+ *	and nothing is recorded unless the directory exists, belongs to root,
+ *	and is writable for everybody and sticky.
+ */
+struct statsrec {
+    unsigned int magic;
+    unsigned int uid;			/* the file's owner, when read */
+    long long when;
+    unsigned int flags;
+    unsigned int usecs[NPHASES + 1];	/* per phase, then in total */
+    unsigned short forks;
+    unsigned short hits;
+};
 
-	value = ppath(interpret(value, TRUE));
-	bind = mkbind(name, value);
-	free(value);
-	return bind;
-    } else {
-	return mkbind(name, interpret(value, FALSE));
-    }
+/*
+ *	End the phase before next (if any) and start timing next.
+ */
+void
+phase(int next)
+{
+    static struct timespec start;
+    struct timespec now;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &now);
+    if (next > 0)
+	PhaseUsecs[next - 1] = (now.tv_sec - start.tv_sec) * 1000000 +
+	    (now.tv_nsec - start.tv_nsec) / 1000;
+    start = now;
 }
 
 /*
- *	Interpret the given string with respect to variables etc.
- *	(Result is static shared string)
+ *	Add a record of this run to the stats file.
  */
-char *
-interpret(const char *string, int pathcompress)
+void
+record_stats(void)
 {
-    static char tmp[BIGBUFSIZ];
-    static char buf[BIGBUFSIZ];
-    char *p, *q;
-
-    if (string == NULL)
-	return NULL;
+    struct statsrec rec;
+    struct stat st;
+    char path[sizeof(STATS_FILE) + 32], old[sizeof(path) + 4];
+    int fd, forks, hits, n;
 
-    p = strcpy(tmp, string);
-    q = buf;
+    phase(NPHASES);
 
-    while (*p != '\0' && q < &buf[sizeof(buf)] - 1) {
-	char *oq = q;
-
-	switch (*p++) {
-	  case '~':
-	    tilde(&p, &q, &buf[sizeof(buf)] - q);
-	    break;
+    /* Only in a directory like /tmp, so that nobody can take ours away */
+    if (stat(RUNDIR, &st) < 0 || !S_ISDIR(st.st_mode) || st.st_uid != 0 ||
+	(st.st_mode & (S_IWOTH | S_ISVTX)) != (S_IWOTH | S_ISVTX))
+	return;
 
-	  case '$':
-	    if (*p != '(') {
-		expand(&p, &q, &buf[sizeof(buf)] - q);
-		if (pathcompress && q == oq) {
-		    /* Don't let an empty expansion lead to an empty
-		     * path component being created.
-		     */
-		    if (q > buf && q[-1] == ':' && *p == '\0')
-			q--;
-		    else if ((q == buf || q[-1] == ':') && *p == ':')
-			p++;
-		}
-		break;
-	    }
-	    // FALL_THROUGH
-
-	  case '`':
-	    p--;
-	    compute(&p, &q, &buf[sizeof(buf)] - q);
-	    if (pathcompress && q == oq) {
-		/* Don't let an empty expansion lead to an empty
-		 * path component being created.
-		 */
-		if (q > buf && q[-1] == ':' && *p == '\0')
-		    q--;
-		else if ((q == buf || q[-1] == ':') && *p == ':')
-		    p++;
-	    }
-	    break;
-	  case '\\':
-	    switch (*p) {
-	      case 'n': *q++ = '\n'; break;
-	      case 'r': *q++ = '\r'; break;
-	      case 't': *q++ = '\t'; break;
-	      default:
-		if (isdigit(*p))
-		    *q++ = strtol(p, &p, 8);
-		else
-		    *q++ = *p++;
-	    }
-	    break;
-	  default:
-	    *q++ = *(p-1);
-	    break;
-	}
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = STATS_MAGIC;
+    rec.uid = getuid();
+    rec.when = time(NULL);
+    rec.flags = SessionFlags;
+    for (n = 0; n < NPHASES; n++) {
+	rec.usecs[n] = PhaseUsecs[n];
+	rec.usecs[NPHASES] += PhaseUsecs[n];
     }
-    *q = '\0';
+    esh_counts(E, &forks, &hits);
+    rec.forks = forks;
+    rec.hits = hits;
 
-    return buf;
+    snprintf(path, sizeof(path), "%s.%u", STATS_FILE, rec.uid);
+    if ((fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_NOFOLLOW |
+		   O_CLOEXEC, 0644)) < 0)
+	return;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_uid == rec.uid &&
+	st.st_size % sizeof(rec) == 0 &&
+	write(fd, &rec, sizeof(rec)) == sizeof(rec) &&
+	st.st_size >= (off_t) (2 * STATS_SLOTS - 1) * (off_t) sizeof(rec)) {
+	snprintf(old, sizeof(old), "%s.old", path);
+	(void) rename(path, old);
+    }
+    (void) close(fd);
 }
 
 /*
- *	Expand ~user to their home directory
- *	(or leave as-is if the user is unknown).
+ *	Append the records in the given stats file, if it belongs to uid, to
+ *	*recs (of which there are *n).
  */
-
 void
-tilde(char **src, char **dst, int dstlen)
+read_stats(const char *path, uid_t uid, struct statsrec **recs, int *n)
 {
-    char *p = *src;
-    struct passwd *pw;
+    struct statsrec rec;
+    struct stat st;
+    FILE *fp;
 
-    /* Scan username */
-    while (isalnum(*p) || *p == '_' || *p == '-' || *p == '.') p++;
-
-    if (*p == **src) {
-	pw = getpwuid(getuid());
-    } else {
-	int len = p - *src;
-	char tmp[len + 1];
-	memcpy(tmp, *src, len);
-	tmp[len] = '\0';
-	pw = getpwnam(tmp);
+    if ((fp = fopen(path, "re")) == NULL)
+	return;
+    if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) &&
+	st.st_uid == uid) {
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+	    if (rec.magic != STATS_MAGIC)
+		continue;
+	    rec.uid = uid;
+	    if (*n % 1024 == 0)
+		*recs = xalloc(*recs, (*n + 1024) * sizeof(rec));
+	    (*recs)[(*n)++] = rec;
+	}
     }
+    (void) fclose(fp);
+}
 
-    if (pw == NULL) {
-	if (dstlen > 0)
-	    *(*dst++) = '~';
-	p = *src;
-    } else {
-	int len = strlen(pw->pw_dir);
-
-	if (len > dstlen)
-	    len = dstlen;
-
-	memcpy(*dst, pw->pw_dir, len);
+int
+cmpuint(const void *a, const void *b)
+{
+    unsigned int x = *(unsigned int *) a, y = *(unsigned int *) b;
 
-	*dst += len;
-    }
+    return x < y ? -1 : x > y;
+}
 
-    *src = p;
+int
+cmpuid(const void *a, const void *b)
+{
+    return cmpuint(&((struct statsrec *) a)->uid, &((struct statsrec *) b)->uid);
 }
 
 /*
- *	Parse and expand the given variable that src points to and
- *	copy the result into dst.  Update both src and dst pointers.
- *	Eg. expand("$foo/baz", "xxxxxxxx", 8) with environ = {"foo=bar", NULL}
- *	would give "$foo/baz", "barxxxxx"
- *	      with      ^=src      ^=dst
+ *	Print the 50th, 95th, and 99th percentiles of the values in v.
  */
 void
-expand(char **src, char **dst, int dstlen)
+percentiles(const char *name, unsigned int *v, int n, double scale)
 {
-    register char *p, *q;
-    char delim, *value, *defvalue = "";
-    int brace = FALSE;
-
-    if (**src == '{' || **src == '(') {
-	(*src)++;
-	brace = TRUE;
-    }
-
-    p = *src;
-    while (*p != '\0' && (isalnum(*p) || *p == '_')) p++;
-
-    delim = *p;
-    *p = '\0';
-    value = getenv(*src);
-    if (brace) {
-	*p = delim;
-	if (delim != '\0' && delim != '}' && delim != ')')
-	    defvalue = ++p;
-	while (*p != '\0' && *p != '}' && *p != ')') p++;
-	delim = *p;
-	*p = '\0';
-    }
-    *src = p;
-
-    if (value == NULL)
-	value = defvalue;
-
-    /* copy value to dst */
-    for (p = value, q = *dst; *p != '\0' && dstlen > 0; p++, q++, dstlen--)
-	*q = *p;
-
-    /* put back source delimiter update pointers */
-    **src = delim;
-    if (brace && (delim == '}' || delim == ')'))
-	(*src)++;
-    *dst = q;
+    static const int pcts[] = {50, 95, 99};
+    int i;
+
+    qsort(v, n, sizeof(*v), cmpuint);
+    printf("  %-8s", name);
+    for (i = 0; i < 3; i++)
+	printf(" %9.*f", scale == 1 ? 0 : 2, v[(n * pcts[i] + 99) / 100 - 1] / scale);
+    putchar('\n');
 }
 
 /*
- *	Parse and compute the given command by running it through a pipe and
- *	picking up the result.  Will update both src and dst pointers.
- *	Eg. compute("`arch`/foo", "xxxxxxxx", 8)
- *	would give  "`arch`/foo", "sun4xxxx"
- *	      with         ^=src       ^=dst
+ *	Summarize the records of n runs.
  */
 void
-compute(char **srcp, char **dstp, int dstlen)
+summarize(const char *who, struct statsrec *recs, int n)
 {
-    char *src = *srcp;
-    char *dst = *dstp;
-    char *p = NULL, *q, delim;
-    FILE *pipe;
-
-    if (src[0] == '$' && src[1] == '(') {
-	// $(...)
-	int parens = 1;
-	src += 2;
-	for (p = src; *p != '\0'; p++) {
-	    if (*p == '(') {
-		parens++;
-	    } else if (*p == ')') {
-		parens--;
-		if (parens == 0)
-		    break;
-	    }
-	}
-    } else if (*src == '`') {
-	// `...`
-	p = strchr(++src, '`');
+    unsigned int *v = xalloc(NULL, n * sizeof(unsigned int));
+    int i, k, interactive = 0;
+
+    for (i = 0; i < n; i++)
+	if (recs[i].flags & SESSION_INTERACTIVE)
+	    interactive++;
+    printf("%s: %d runs (%d interactive)\n", who, n, interactive);
+    for (k = -1; k < NPHASES; k++) {
+	for (i = 0; i < n; i++)
+	    v[i] = recs[i].usecs[k < 0 ? NPHASES : k];
+	percentiles(k < 0 ? "total" : PhaseNames[k], v, n, 1000.0);
     }
-
-    if (p == NULL)
-	p = src + strlen(src);
-
-    delim = *p;
-    *p = '\0';
-
-    /* Ignore errors if the command is prefixed by '?' */
-    int ignore_errors = *src == '?';
-
-    if (ignore_errors)
-	src++;
-
-    pipe = popen(src, "r");
-    if (pipe == NULL) {
-	if (!ignore_errors)
-	    perror(src);
-    } else {
-	if (fgets(dst, dstlen, pipe) == NULL)
-	    *dst = '\0';
-	if ((q = strchr(dst, '\n')) != NULL)
-	    *q = '\0';
-
-	pclose(pipe);
-    }
-
-    *p = delim;
-    if (delim != '\0')
-	p++;
-
-    *srcp = p;
-    dst += strlen(dst);
-    *dstp = dst;
+    for (i = 0; i < n; i++)
+	v[i] = recs[i].forks;
+    percentiles("forks", v, n, 1);
+    for (i = 0; i < n; i++)
+	v[i] = recs[i].hits;
+    percentiles("hits", v, n, 1);
+
+    free(v);
 }
 
 /*
- *	A version of assoc(iate) for foo=bar type bindings.
- *	Eg. bassoc("foo", {"abc=def", "foo=bar", NULL}) => {"foo=bar", ...}
- *	    bassoc("foo=xyz", {"abc=def", "foo=bar", NULL}) => {"foo=bar", ...}
- *	    bassoc("baz", {"abc=def", "foo=bar", NULL}) => {NULL}
+ *	Print the login latency percentiles per user and per phase.
  */
-char **
-bassoc(const char *key, char **environ)
+void
+print_stats(void)
 {
-    register char **ee;
-    register const char *p, *q;
-
-    for (ee = environ; *ee != NULL; ee++) {
-	for (p = key, q = *ee; *p == *q; p++, q++)
-	    if (*p == '\0' || *p == '=')
-		break;
-	if ((*p == '\0' || *p == '=') && (*q == '\0' || *q == '='))
-	    break;
+    const char *base = strrchr(STATS_FILE, '/') + 1;
+    struct statsrec *recs = NULL;
+    struct dirent *de;
+    struct passwd *pw;
+    char path[BUFSIZ], who[32], *end;
+    unsigned long uid;
+    int i, j, n = 0;
+    DIR *dd;
+
+    if ((dd = opendir(RUNDIR)) == NULL) {
+	fprintf(stderr, "esh: no stats in %s\n", RUNDIR);
+	exit(1);
     }
+    while ((de = readdir(dd)) != NULL) {
+	if (strncmp(de->d_name, base, strlen(base)) != 0 ||
+	    de->d_name[strlen(base)] != '.')
+	    continue;
+	uid = strtoul(de->d_name + strlen(base) + 1, &end, 10);
+	if (end == de->d_name + strlen(base) + 1 ||
+	    (*end != '\0' && strcmp(end, ".old") != 0))
+	    continue;
+	snprintf(path, sizeof(path), "%s/%s", RUNDIR, de->d_name);
+	read_stats(path, (uid_t) uid, &recs, &n);
+    }
+    (void) closedir(dd);
 
-    return ee;
+    if (n == 0) {
+	printf("no runs recorded\n");
+	exit(0);
+    }
+
+    printf("%-10s %9s %9s %9s\n", "(ms)", "p50", "p95", "p99");
+    summarize("all users", recs, n);
+    qsort(recs, n, sizeof(struct statsrec), cmpuid);
+    for (i = 0; i < n; i = j) {
+	for (j = i + 1; j < n && recs[j].uid == recs[i].uid; j++)
+	    ;
+	if ((pw = getpwuid(recs[i].uid)) != NULL)
+	    snprintf(who, sizeof(who), "%s", pw->pw_name);
+	else
+	    snprintf(who, sizeof(who), "%u", recs[i].uid);
+	summarize(who, recs + i, j - i);
+    }
+
+    free(recs);
+    exit(0);
 }
 
 /*
- * Edit our environment by defaulting, replacing, removing, or appending
- * the given binding (which should be of the form "var=val").
+ *	Give up if a libesh call failed.
  */
 void
-editenv(enum editop op, const char *binding)
+check(int rc)
 {
-    static char **EnvEnd = NULL;
-    int envuse = EnvEnd - EnvBuf;
-    
-    if (op != OP_APPEND) {
-	char **ee = bassoc(binding, EnvBuf);
-	if (*ee != NULL) {
-	    switch (op) {
-		/* Only add the binding if the var is unbound */
-	      case OP_DEFAULT:
-		return;
-	      case OP_REPLACE:
-		/* Replace old binding */
-		*ee = (char *) binding;
-		return;
-	      case OP_REMOVE:
-		/* Remove existing binding */
-		for (; *ee != NULL; ee++) {
-		    ee[0] = ee[1];
-		}
-		EnvEnd--;
-		return;
-	      case OP_APPEND:
-	      case OP_KEYWORD:
-		/* To keep the compiler happy... */
-		break;
-	    }
-	}
-    }
-
-    /* Append the new binding */
-    if (envuse == EnvSiz) {
-	EnvSiz += ENVGROWTH;
-	environ = EnvBuf = xalloc(EnvBuf, sizeof(char *) * (EnvSiz + 1));
-	EnvEnd = EnvBuf + envuse;
+    if (rc < 0) {
+	fprintf(stderr, "esh: %s\n", esh_error(E));
+	exit(1);
     }
-    
-    *EnvEnd++ = (char *) binding;
-    *EnvEnd = NULL;
 }
 
 /*
- *	Print and automatically quote a string (sh/csh syntax).
+ *	Interpret the given string in the environment that we're setting up.
+ *	(Result is static shared string)
  */
-void
-fprintq(FILE *stream, const char *string)
+char *
+interpret(const char *string)
 {
-    const char *p;
+    char *result = esh_interpret(E, string);
 
-    if (ShellOut == LISP_FORMAT) {
-	putc('"', stream);
-	for (p = string; *p != '\0'; p++) {
-	    if (*p == '"' || *p == '\\')
-		putc('\\', stream);
-	    putc(*p, stream);
-	}
-	putc('"', stream);
+    if (result == NULL && string != NULL)
+	check(-1);
 
-    } else {
-	putc('\'', stream);
-	for (p = string; *p != '\0'; p++)
-	    if (*p == '\'')
-		fputs("'\"'\"'", stream);
-	    else
-		putc(*p, stream);
-	putc('\'', stream);
-    }
+    return result;
 }
 
 /*
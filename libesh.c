@@ -0,0 +1,5689 @@
+/**
+ **	LIBESH -- the Environmental Meta Shell as a library
+ **
+ **	The environment file parser, interpreter, and keyword engine that
+ **	esh (and pam_esh.so) is built on.  See libesh.h for the interface.
+ **
+ **	Nothing in here looks at or changes the process environment: the
+ **	environment being built lives in the context, commands are run with
+ **	that environment, and all memory comes from the context's allocator.
+ **	Running out of memory unwinds back to the public function that was
+ **	called, which then fails.
+ **
+ **	Copyright (c) 1990-2021, Lennart Lovstrand <esh@lenlolabs.com>
+ **/
+
+#ifdef __linux__
+#define _GNU_SOURCE			/* for sched_getaffinity() */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <setjmp.h>
+#include <spawn.h>
+#include <sys/file.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <glob.h>
+#include <dirent.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#include <fnmatch.h>
+#include <poll.h>
+#include <regex.h>
+#include <time.h>
+
+#include "libesh.h"
+
+#define ESHVERSION	ESH_VERSION
+
+#define	SYSENVFILE	ETCDIR "/environ"
+#define USRENVFILE	"$HOME/.environ"
+#define USRSHELL	"$HOME/.shell"
+#define BIGBUFSIZ	8192
+#define ENVGROWTH	10
+
+#define AUTO_PRUNE_VAR	"ESH_AUTO_PRUNE_PATHS"
+#define RUN_COUNT_VAR	ESH_RUN_COUNT
+#define PPATH_EMPTY_VAR	"PPATH_REMOVE_EMPTY_SUBPATHS"
+#define LIBPATH_VARS_VAR "ESH_LIBPATH_VARS"
+#define MODULEPATH_VAR	"ESH_MODULEPATH"
+#define LOADED_MODULES_VAR "LOADEDMODULES"
+#define MODULES_MAGIC	"esh-modules " ESHVERSION "\n"
+#define MODULE_DEPTH	16
+#define INDEX_MAGIC	"esh-index " ESHVERSION "\n"
+#define INDEX_MIN_SIZE	65536
+#define SHARE_DIR_VAR	"XDG_RUNTIME_DIR"
+#define SHARE_WINDOW_VAR "ESH_SHARE_WINDOW"
+#define SHARE_WINDOW_DEF 0		/* i.e. off */
+#define SHARE_TIMEOUT_VAR "ESH_SHARE_TIMEOUT"
+#define SHARE_TIMEOUT_DEF 10
+#define SHARE_POLL_MS	20
+#define SHARE_SESSION_VARS \
+    " TERM COLORTERM TERM_SESSION_ID WINDOWID TMUX TMUX_PANE STY WINDOW" \
+    " SSH_CLIENT SSH_CONNECTION SSH_TTY SSH_AUTH_SOCK DISPLAY GPG_TTY" \
+    " XDG_SESSION_ID XDG_SESSION_TYPE XDG_SESSION_CLASS XDG_SEAT XDG_VTNR" \
+    " SHLVL OLDPWD _ "
+#define SNAPSHOT_DIR_VAR "XDG_CACHE_HOME"
+#define SNAPSHOT_DIR	"$HOME/.cache"
+#define LOCAL_DIR_VAR	"XDG_RUNTIME_DIR"
+#define LOCAL_DIR	"/tmp"
+#define SNAPSHOT_MAGIC	"esh-snapshot " ESHVERSION "\n"
+#define NO_SNAPSHOT_VAR	"ESH_NO_SNAPSHOT"
+#define HOME_CACHE_VAR	"ESH_HOME_CACHE"
+#define HOME_TIMEOUT_VAR "ESH_HOME_TIMEOUT"
+#define HOME_CACHE_MAGIC "esh-home"
+
+#ifndef O_PATH
+#define O_PATH		O_RDONLY
+#endif
+
+#define FALSE		0
+#define TRUE		(!FALSE)
+
+#define NBUILTINVARS	4		/* see BuiltinVars[] */
+
+#define HASH_INIT	14695981039346656037ULL
+
+/* How the home directory is doing */
+enum { HOME_UNKNOWN, HOME_NONE, HOME_OK, HOME_STALLED };
+
+/* share_begin() results that aren't lock file descriptors */
+#define SHARE_NONE	(-1)
+#define SHARE_HIT	(-2)
+
+/* Entry to the public functions; fails with failure on running out of memory */
+#define ENTER(E, failure) \
+    do { (E)->error = NULL; if (setjmp((E)->fail) != 0) return failure; } while (0)
+
+/*
+ *	A "[~regex]" section selector, compiled the first time it is used.
+ */
+struct selector {
+    char *text;
+    regex_t re;
+    int ok;				/* did it compile? */
+};
+
+/*
+ *	Where the "[...]" sections of a big environment file start, and what
+ *	their keywords are, so that readbinding() can skip over the ones that
+ *	don't apply without reading them (see index_begin()).
+ */
+struct section {
+    long offset;			/* of the "[...]" line */
+    char *words;			/* its keywords, or NULL if not simple */
+};
+
+struct index {
+    char *path;				/* the sidecar file */
+    unsigned long long stamp;		/* of the environment file */
+    struct section *sections;
+    int nsections;
+    int recording;			/* no index yet, so make one */
+    int bad;				/* couldn't, after all */
+};
+
+enum editop {
+    OP_KEYWORD,
+    OP_DEFAULT,
+    OP_REPLACE,
+    OP_REMOVE,
+    OP_APPEND,
+    OP_LIST_APPEND,
+    OP_LIST_PREPEND,
+    OP_LIST_REMOVE,
+};
+
+/*
+ *	Every allocated block is preceded by one of these so that esh_free()
+ *	can find them all.
+ */
+union block {
+    struct {
+	union block *next, *prev;
+    } link;
+    long double align;			/* for whatever follows */
+};
+
+struct esh {
+    esh_alloc_t alloc;			/* the caller's allocator */
+    void *arg;				/* and its argument */
+    union block *blocks;		/* everything we've allocated */
+    jmp_buf fail;			/* where to go when out of memory */
+    const char *error;			/* what went wrong */
+
+    FILE *log;				/* warnings and debug output */
+    int debug;
+    int autoprune;			/* prune *PATH variables */
+
+    char **env;				/* the environment being built */
+    char **envend;
+    int envsiz;
+
+    char **keywords;			/* NULL terminated */
+    int nkeywords;
+    char **keyhash;			/* the same, for looking them up */
+    int keyhashsize;
+    struct selector *selectors;		/* see regex_conditional() */
+    int nselectors;
+    struct index *index;		/* of the file being read, if any */
+
+    char *builtins[NBUILTINVARS];	/* values, once computed */
+
+    struct pathlist *paths;		/* path lists being edited */
+
+    char **inherited;			/* what the environment files start from */
+    char *snappath;
+    unsigned long long snapprint;	/* fingerprint of the inputs */
+    char **snapdeps;			/* "name=hash" (or "name" if unset) */
+    int nsnapdeps;
+    int recording;
+    char *snapshell;			/* shell from a snapshot */
+    char **bound;			/* names the files (un)bound, NULL ended */
+    int nbound;
+
+    char *home;				/* see home_probe() */
+    int homestate;
+    int homefd;
+    char *homecache;
+    struct homefile *homefiles;
+
+    char **deferred;			/* "&name value" bindings, for later */
+    int ndeferred;
+
+    struct module *modules;		/* see modules_index() */
+    int nmodules;
+    char *modpath;			/* what they were found in */
+    struct module *loaded;		/* those in use */
+    int nloaded;
+    int moddepth;
+
+    int swept;				/* see share_sweep() */
+
+    int forks;				/* see esh_counts() */
+    int hits;
+
+    char tmp[BIGBUFSIZ];		/* for interpret() */
+    char buf[BIGBUFSIZ];
+};
+
+static char *readbinding(struct esh *, FILE *);
+static char *interpret(struct esh *, const char *, int);
+static char *newstr(struct esh *, const char *);
+static char **bassoc(const char *, char **);
+static char *mkbind(struct esh *, const char *, const char *);
+static char *getvar(struct esh *, const char *);
+static void loadenv(struct esh *, const char *, const char *, char **);
+static int readenv(struct esh *, const char *);
+static void tilde(struct esh *, char **, char **, int);
+static void expand(struct esh *, char **, char **, int);
+static void compute(struct esh *, char **, char **, int);
+static void copyout(const char *value, char **dst, int dstlen);
+static void expand_word(struct esh *E, const char *word, int len, int pattern,
+			char *out, int outlen);
+static void trim(char *val, const char *pat, int prefix, int longest);
+static void replace(struct esh *E, char *val, const char *pat,
+		    const char *rep, int replen, int anchor, int all);
+static void arithmetic(struct esh *E, char **src, char **dst, int dstlen);
+static long long arith_binary(struct esh *E, const char **pp, int level);
+static long long arith_unary(struct esh *E, const char **pp);
+static int run(struct esh *E, const char *cmd, char *out, int outlen);
+static void init_keywords(struct esh *, const char *);
+static void add_keyword(struct esh *, const char *);
+static void *xalloc(struct esh *E, void *mem, long siz);
+static void xfree(struct esh *E, void *mem);
+static void fail(struct esh *E, const char *why);
+static unsigned long long hash(unsigned long long h, const void *data, long len);
+static unsigned long long hash_time(unsigned long long h,
+				    const struct timespec *ts);
+static int envnum(struct esh *E, const char *var, int def);
+static int share_begin(struct esh *E, const char *cmd, char *dst, int dstlen);
+static void share_end(struct esh *E, int share, const char *cmd,
+		      const char *result);
+static void editenv(struct esh *E, enum editop op, const char *binding);
+static void snapshot_bound(struct esh *E, const char *binding);
+static char **envchanges(struct esh *E, char **old);
+static void layout(struct esh *E, const char *hot);
+static void pathedit(struct esh *E, enum editop op, const char *binding);
+static void pathflush(struct esh *E, const char *name, int forget);
+static char *prune(struct esh *E, const char *name, const char *value);
+static void libpaths(struct esh *E);
+static char *lookup(struct esh *E, const char *name);
+static char *builtin(struct esh *E, const char *name);
+static int section_exec(struct esh *E, char *cmd);
+static int readfile(struct esh *E, char *src, char *dst, int dstlen,
+		    int ignore_errors);
+static int skipped(struct esh *E, const char *name);
+static void depend(struct esh *E, const char *name);
+static void depend_file(struct esh *E, const char *pattern);
+static void import(struct esh *E, const char *pattern);
+static void use(struct esh *E, const char *modules);
+static void defer(struct esh *E, const char *binding);
+static int deferrable(const char *name);
+static int conditional(struct esh *E, const char *name);
+static void index_begin(struct esh *E, struct index *ix, const char *file,
+			FILE *stream);
+static void index_end(struct esh *E, struct index *ix);
+static void index_add(struct esh *E, long offset, const char *header);
+static int index_skip(struct esh *E, FILE *stream, long offset);
+static char *cache_path(struct esh *E, const char *name);
+static int vercmp(const char *a, const char *b);
+static unsigned long long hash_file(struct esh *E, unsigned long long h,
+				    const char *file, int contents);
+static void nosnapshot(struct esh *E, const char *why);
+static int makedir(char *dir);
+static struct homefile *home_lookup(struct esh *E, const char *path);
+static FILE *home_fopen(struct esh *E, const char *path);
+static void snapshot_begin(struct esh *E, char **inherited,
+			   const char *sysenv, const char *usrenv);
+static int snapshot_load(struct esh *E);
+static void snapshot_save(struct esh *E, const char *shell);
+
+
+/*
+ *	Add the system and user environments to what we've inherited.
+ */
+static void
+loadenv(struct esh *E, const char *sysfile, const char *usrfile,
+	char **inherited)
+{
+    char *sysenv = newstr(E, interpret(E, sysfile, FALSE));
+    char *usrenv = newstr(E, interpret(E, usrfile, FALSE));
+
+    /* use the result from last time if nothing has changed */
+    snapshot_begin(E, inherited, sysenv, usrenv);
+    if (snapshot_load(E))
+	return;
+
+    /* add global environment */
+    if (E->debug)
+	fprintf(E->log, "[--system environment--]\n");
+    readenv(E, sysenv);
+
+    /* add private environment */
+    if (E->debug)
+	fprintf(E->log, "[--user environment--]\n");
+    readenv(E, usrenv);
+
+    /* turn any remaining path lists back into strings */
+    pathflush(E, NULL, TRUE);
+
+    libpaths(E);
+}
+
+/*
+ *	Read the bindings in file into our environment.  Returns -1 if the
+ *	file can't be opened.
+ */
+static int
+readenv(struct esh *E, const char *file)
+{
+    FILE *stream;
+    char *binding, *p;
+    struct index index, *outer = E->index;
+    int later;
+
+    if (file == NULL)
+	return 0;
+
+    if (strcmp(file, "-") == 0)
+	stream = stdin;
+    else {
+	stream = home_fopen(E, file);
+	if (stream == NULL)
+	    return -1;
+    }
+
+    index_begin(E, &index, file, stream);
+    E->index = index.path != NULL ? &index : NULL;
+
+    while ((binding = readbinding(E, stream)) != NULL) {
+	enum editop op = OP_REPLACE;
+
+	if (E->debug)
+	    fprintf(E->log, "[%s]\n", binding);
+
+	if (skipped(E, binding)) {
+#ifdef DISABLE_NONINTERACTIVE_PS1
+	    /* Don't let an inherited prompt through either */
+	    if (strncmp(binding, "PS1=", 4) == 0)
+		editenv(E, OP_REMOVE, binding);
+#endif
+	    continue;
+	}
+
+	/* A '!' marks a volatile binding that must never be snapshot, a
+	 * '%' one that is only meant for interactive sessions, and a '&' one
+	 * that can wait until the shell has started.
+	 */
+	later = deferrable(binding);
+	for (p = binding; *binding == '!' || *binding == '%' || *binding == '&';
+	     binding++) {
+	    if (*binding == '!')
+		nosnapshot(E, binding);
+	}
+	if (later) {
+	    defer(E, binding);
+	    continue;
+	} else if (memchr(p, '&', binding - p) != NULL && E->log != NULL) {
+	    fprintf(E->log, "Warning: only plain bindings can be deferred: "
+		    "%.*s\n", (int) strcspn(binding, "="), binding);
+	}
+
+	/* "< file" merges a KEY=VALUE file (or several) */
+	if (*binding == '<') {
+	    import(E, binding + 1);
+	    continue;
+	}
+
+	/* "use module ..." */
+	if (*binding == '@') {
+	    use(E, binding + 1);
+	    continue;
+	}
+
+	switch (*binding) {
+	  case '=':
+	    op = OP_KEYWORD;
+	    binding++;
+	    break;
+	  case '\\':
+	    binding++;
+	    break;
+	  case '-':
+	    op = OP_REMOVE;
+	    binding++;
+	    break;
+	  case '?':
+	    op = OP_DEFAULT;
+	    binding++;
+	    break;
+	}
+
+	/* "name+=value", "name^=value" (=+), or "name-=value"? */
+	if (op == OP_REPLACE && (p = strchr(binding, '=')) != NULL &&
+	    p > binding && strchr("+^-", p[-1]) != NULL) {
+	    op = p[-1] == '+' ? OP_LIST_APPEND :
+		p[-1] == '^' ? OP_LIST_PREPEND : OP_LIST_REMOVE;
+	    memmove(p - 1, p, strlen(p) + 1);
+	}
+
+	if (op == OP_KEYWORD) {
+	    add_keyword(E, binding);
+	} else if (builtin(E, binding) != NULL) {
+	    if (E->log != NULL)
+		fprintf(E->log, "Warning: %.*s is read-only -- ignored\n",
+			(int) strcspn(binding, "="), binding);
+	} else if (op >= OP_LIST_APPEND) {
+	    pathedit(E, op, binding);
+	} else {
+	    pathflush(E, binding, TRUE);
+	    if (op == OP_DEFAULT)
+		depend(E, binding);
+	    editenv(E, op, binding);
+	}
+
+	/* (An import or a module may have read a file of its own) */
+	E->index = index.path != NULL ? &index : NULL;
+    }
+
+    index_end(E, &index);
+    E->index = outer;
+
+    if (stream != stdin)
+	(void) fclose(stream);
+    return 0;
+}
+
+/*
+ *	Put off a "name=value" binding, with the value as it was written,
+ *	until after the shell has started (see esh_deferred()).
+ */
+static void
+defer(struct esh *E, const char *binding)
+{
+    if (E->debug)
+	fprintf(E->log, "# Deferring %s\n", binding);
+
+    E->deferred = xalloc(E, E->deferred, (E->ndeferred + 2) * sizeof(char *));
+    E->deferred[E->ndeferred++] = newstr(E, binding);
+    E->deferred[E->ndeferred] = NULL;
+}
+
+/*
+ *	Get the keywords of a "[...]" section header (without the brackets,
+ *	separated by single spaces), unless there's more to it than that,
+ *	like a `command`, a [ test ], or a trailing '_' binding.
+ */
+static char *
+section_words(struct esh *E, const char *header)
+{
+    const char *end = strrchr(header, ']'), *p, *q;
+    char *words, *w;
+
+    if (end == NULL || end[1 + strspn(end + 1, " \t")] != '\0')
+	return NULL;
+
+    words = w = xalloc(E, NULL, end - header + 1);
+    for (p = header + 1; p < end; p = q) {
+	p += strspn(p, " \t");
+	q = p + strcspn(p, " \t");
+	if (q > end)
+	    q = end;
+	if (*p == '[' || memchr(p, '`', q - p) != NULL ||
+	    memchr(p, '$', q - p) != NULL) {
+	    xfree(E, words);
+	    return NULL;
+	}
+	if (q > p) {
+	    if (w > words)
+		*w++ = ' ';
+	    memcpy(w, p, q - p);
+	    w += q - p;
+	}
+    }
+    *w = '\0';
+
+    return words;
+}
+
+/*
+ *	Read a section index, unless it's missing or for another version of
+ *	the environment file.
+ */
+static int
+index_read(struct esh *E, struct index *ix)
+{
+    char line[BIGBUFSIZ], *p, *q;
+    struct section *s;
+    FILE *fp;
+    int ok;
+
+    if ((fp = fopen(ix->path, "r")) == NULL)
+	return FALSE;
+    ok = fgets(line, sizeof(line), fp) != NULL &&
+	strcmp(line, INDEX_MAGIC) == 0 &&
+	fgets(line, sizeof(line), fp) != NULL &&
+	strncmp(line, "F\t", 2) == 0 &&
+	strtoull(line + 2, NULL, 16) == ix->stamp;
+
+    while (ok && fgets(line, sizeof(line), fp) != NULL) {
+	if ((p = strchr(line, '\n')) != NULL)
+	    *p = '\0';
+	if (line[0] != 'S' && line[0] != 'X') {
+	    ok = FALSE;
+	    break;
+	}
+
+	ix->sections = xalloc(E, ix->sections,
+			      (ix->nsections + 1) * sizeof(struct section));
+	s = &ix->sections[ix->nsections++];
+	s->offset = strtol(line + 2, &q, 10);
+	s->words = line[0] == 'S' && *q == '\t' ? newstr(E, q + 1) : NULL;
+    }
+    (void) fclose(fp);
+
+    return ok;
+}
+
+/*
+ *	Start reading an environment file.  A big one gets an index of its
+ *	sections in a sidecar file in the cache directory, made the first
+ *	time around and used from then on (for as long as the file stays
+ *	the same) to skip the sections that don't apply.
+ */
+static void
+index_begin(struct esh *E, struct index *ix, const char *file, FILE *stream)
+{
+    unsigned long long h;
+    char name[32];
+    struct stat st;
+
+    memset(ix, 0, sizeof(*ix));
+    if (stream == stdin || fstat(fileno(stream), &st) < 0 ||
+	!S_ISREG(st.st_mode) || st.st_size < INDEX_MIN_SIZE)
+	return;
+
+    h = hash(HASH_INIT, &st.st_dev, sizeof(st.st_dev));
+    h = hash(h, &st.st_ino, sizeof(st.st_ino));
+    h = hash(h, &st.st_size, sizeof(st.st_size));
+    h = hash_time(h, &st.st_mtim);
+    h = hash_time(h, &st.st_ctim);
+    ix->stamp = h;
+
+    snprintf(name, sizeof(name), "index-%016llx",
+	     hash(HASH_INIT, file, strlen(file)));
+    ix->path = cache_path(E, name);
+
+    if (index_read(E, ix)) {
+	if (E->debug)
+	    fprintf(E->log, "# Using the index of %d sections in %s\n",
+		    ix->nsections, file);
+    } else {
+	xfree(E, ix->sections);
+	ix->sections = NULL;
+	ix->nsections = 0;
+	ix->recording = TRUE;
+    }
+}
+
+/*
+ *	Done reading the file: save the index, if we made one.
+ */
+static void
+index_end(struct esh *E, struct index *ix)
+{
+    char *dir, *tmp, *slash;
+    struct section *s;
+    FILE *stream;
+    int fd;
+
+    if (ix->path == NULL)
+	return;
+
+    if (ix->recording && !ix->bad) {
+	dir = newstr(E, ix->path);
+	if ((slash = strrchr(dir, '/')) != NULL)
+	    *slash = '\0';
+	tmp = xalloc(E, NULL, strlen(ix->path) + 48);
+	sprintf(tmp, "%s.%d.%p", ix->path, (int) getpid(), (void *) E);
+
+	if ((slash == NULL || makedir(dir) >= 0) &&
+	    (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		       0600)) >= 0) {
+	    if ((stream = fdopen(fd, "w")) == NULL) {
+		(void) close(fd);
+		(void) unlink(tmp);
+	    } else {
+		fprintf(stream, "%sF\t%016llx\n", INDEX_MAGIC, ix->stamp);
+		for (s = ix->sections; s < ix->sections + ix->nsections; s++) {
+		    if (s->words != NULL)
+			fprintf(stream, "S\t%ld\t%s\n", s->offset, s->words);
+		    else
+			fprintf(stream, "X\t%ld\n", s->offset);
+		}
+		if (fclose(stream) != 0 || rename(tmp, ix->path) < 0)
+		    (void) unlink(tmp);
+		else if (E->debug)
+		    fprintf(E->log, "# Saved an index of %d sections in %s\n",
+			    ix->nsections, ix->path);
+	    }
+	}
+	xfree(E, tmp);
+	xfree(E, dir);
+    }
+
+    for (s = ix->sections; s < ix->sections + ix->nsections; s++)
+	xfree(E, s->words);
+    xfree(E, ix->sections);
+    xfree(E, ix->path);
+}
+
+/*
+ *	Add the "[...]" header at offset to the index being made.
+ */
+static void
+index_add(struct esh *E, long offset, const char *header)
+{
+    struct index *ix = E->index;
+    struct section *s;
+
+    ix->sections = xalloc(E, ix->sections,
+			  (ix->nsections + 1) * sizeof(struct section));
+    s = &ix->sections[ix->nsections++];
+    s->offset = offset;
+    s->words = section_words(E, header);
+}
+
+/*
+ *	The section at offset doesn't apply, so move on to the next one that
+ *	might, without reading any of those in between.  Returns FALSE if
+ *	the index doesn't know about it.
+ */
+static int
+index_skip(struct esh *E, FILE *stream, long offset)
+{
+    struct index *ix = E->index;
+    struct section *s = ix->sections, *end = s + ix->nsections, *mid, *at;
+    char words[BIGBUFSIZ], *w, *next;
+    int n;
+
+    /* Find the section we're at */
+    for (n = ix->nsections; n > 0; ) {
+	mid = s + n / 2;
+	if (mid->offset < offset) {
+	    s = mid + 1;
+	    n -= n / 2 + 1;
+	} else {
+	    n /= 2;
+	}
+    }
+    if (s == end || s->offset != offset)
+	return FALSE;
+
+    for (at = s++; s < end; s++) {
+	if (s->words == NULL)
+	    break;
+	snprintf(words, sizeof(words), "%s", s->words);
+	for (w = strtok_r(words, " ", &next); w != NULL;
+	     w = strtok_r(NULL, " ", &next))
+	    if (conditional(E, w))
+		break;
+	if (w != NULL)
+	    break;
+    }
+
+    if (E->debug && s > at + 1)
+	fprintf(E->log, "# Skipping %d more sections\n", (int) (s - at - 1));
+    return fseek(stream, s < end ? s->offset : 0, s < end ? SEEK_SET : SEEK_END) == 0;
+}
+
+/*
+ *	Make a freshly allocated environment variable binding.
+ *	mkbind("foo", "bar") => "foo=bar"
+ */
+static char *
+mkbind(struct esh *E, const char *name, const char *value)
+{
+    char *buf = xalloc(E, NULL, strlen(name) + 1 + strlen(value) + 1);
+
+    sprintf(buf, "%s=%s", name, value);
+
+    return buf;
+}
+
+/*
+ *	Keyword processing (aka conditional).
+ */
+
+static const char *const BuiltinKeywords[] = {
+    /* these will always match */
+    "all",
+
+    /* operating systems */
+#ifdef __AIX
+    "aix",
+#endif
+#ifdef __ANDROID__
+    "android",
+#endif
+#ifdef __APPLE__
+    "apple",
+#include <TargetConditionals.h>
+#if TARGET_OS_IPHONE || TARGET_IPHONE_SIMULATOR
+    "iphone",
+    "ios",
+#elif TARGET_OS_MAC
+    "osx",
+    "macos",
+#endif // !TARGET_OS_MAC
+#endif // __APPLE_
+#ifdef DARWIN
+    "darwin",
+#endif
+#ifdef __hpux
+    "hp-ux",
+#endif
+#ifdef __linux__
+    "linux",
+#endif
+#ifdef __MACH__
+    "mach",
+#endif
+#ifdef __sun
+#ifdef __SVR4
+    "solaris",
+#else
+    "sunos",
+#endif // !__SVR4
+#endif // __sun
+#ifdef __unix__
+    "unix",
+#ifdef BSD
+    "bsd",
+#endif // BSD
+#endif
+#ifdef _WIN32
+    "win32",
+    "windows",
+#elif defined(_WIN64)
+    "win64",
+    "windows",
+#endif
+
+	/* architectures */
+#ifdef __i386__
+    "i386",
+#endif
+#ifdef __i486__
+    "i486",
+#endif
+#ifdef __i586__
+    "i586",
+#endif
+#ifdef __i686__
+    "i686",
+#endif
+#if defined(__i386__) || defined(__i486__) || defined(__i586__) || defined (__i686__)
+    "ixxx",
+    "intel",
+#endif
+#if defined(__ppc__) || defined(__POWERPC__) || defined(_ARCH_PPC)
+    "ppc",
+    "powerpc",
+#endif
+#if defined(__arm__)
+    "arm",
+#endif
+#if defined(__x86_64__)
+    "x86_64",
+    "amd64",
+#endif
+#if defined(__aarch64__)
+    "aarch64",
+    "arm64",
+#endif
+
+    NULL
+};
+
+/*
+ *	Find the place of word in the keyword hash table (where it either is
+ *	or would go), ignoring case.
+ */
+static char **
+keyword_slot(struct esh *E, const char *word)
+{
+    unsigned long long h = HASH_INIT;
+    unsigned char c;
+    const char *p;
+    int i, mask = E->keyhashsize - 1;
+
+    for (p = word; *p != '\0'; p++) {
+	c = tolower(*p);
+	h = hash(h, &c, 1);
+    }
+
+    for (i = h & mask; E->keyhash[i] != NULL; i = (i + 1) & mask)
+	if (strcasecmp(E->keyhash[i], word) == 0)
+	    break;
+
+    return &E->keyhash[i];
+}
+
+/*
+ *	Add a new word to the list of known keywords.
+ */
+static void
+add_keyword(struct esh *E, const char *word)
+{
+    char **kk;
+
+    /* Don't add NULL words */
+    if (word == NULL || *word == '\0')
+	return;
+
+    if (E->debug)
+	fprintf(E->log, "# Adding keyword \"%s\"\n", word);
+
+    /* Keep the hash table no more than half full */
+    if (2 * (E->nkeywords + 1) > E->keyhashsize) {
+	xfree(E, E->keyhash);
+	E->keyhashsize = E->keyhashsize == 0 ? 64 : 2 * E->keyhashsize;
+	E->keyhash = xalloc(E, NULL, E->keyhashsize * sizeof(char *));
+	memset(E->keyhash, 0, E->keyhashsize * sizeof(char *));
+	for (kk = E->keywords; *kk != NULL; kk++)
+	    *keyword_slot(E, *kk) = *kk;
+    }
+
+    /* Check if we might already got it */
+    kk = keyword_slot(E, word);
+    if (*kk != NULL)
+	return;
+
+    E->keywords = xalloc(E, E->keywords, (E->nkeywords + 2) * sizeof(char *));
+    E->keywords[E->nkeywords++] = *kk = newstr(E, word);
+    E->keywords[E->nkeywords] = NULL;
+}
+
+/*
+ *	Add "@group" keywords for all the groups that the user (or we, if
+ *	NULL) belong to.
+ */
+static void
+add_keyword_groups(struct esh *E, const char *user)
+{
+    struct passwd pwent, *pw = NULL;
+    struct group grent, *gr;
+    char pwbuf[BUFSIZ], *buf = NULL, *word;
+    int n = 0, i, size = BUFSIZ, rc;
+    gid_t *groups = NULL;
+
+    if (user == NULL) {
+	/* The kernel already knows, so there's no need to ask around */
+	if ((n = getgroups(0, NULL)) < 0)
+	    return;
+	groups = xalloc(E, NULL, (n + 1) * sizeof(gid_t));
+	if ((n = getgroups(n, groups)) < 0)
+	    n = 0;
+	groups[n++] = getgid();
+    } else if (getpwnam_r(user, &pwent, pwbuf, sizeof(pwbuf), &pw) == 0 &&
+	       pw != NULL) {
+	n = 32;
+	do {
+	    groups = xalloc(E, groups, (n + 1) * sizeof(gid_t));
+	    rc = getgrouplist(user, pw->pw_gid, (void *) groups, &n);
+	} while (rc < 0 && n > 0);
+    }
+
+    for (i = 0; i < n; i++) {
+	/* Big groups have long member lists */
+	for (;;) {
+	    buf = xalloc(E, buf, size);
+	    rc = getgrgid_r(groups[i], &grent, buf, size, &gr);
+	    if (rc != ERANGE || size >= 1024 * 1024)
+		break;
+	    size *= 2;
+	}
+	if (rc != 0 || gr == NULL)
+	    continue;
+	word = xalloc(E, NULL, strlen(gr->gr_name) + 2);
+	sprintf(word, "@%s", gr->gr_name);
+	add_keyword(E, word);
+	xfree(E, word);
+    }
+
+    xfree(E, buf);
+    xfree(E, groups);
+}
+
+/*
+ *	Add qualified & unqualified hostname + all parent domains too.
+ *
+ *	Warning: Will trash hostname in the process.
+ */
+static void
+add_keyword_hostname(struct esh *E, char *hostname)
+{
+    char *p, *q;
+
+    add_keyword(E, hostname);
+
+    p = strchr(hostname, '.');
+    if (p != NULL) {
+	*p++ = '\0';
+	add_keyword(E, hostname);
+	while ((q = strchr(p, '.')) != NULL) {
+	    add_keyword(E, p);
+	    *q++ = '\0';
+	    p = q;
+	}
+    }
+}
+
+/*
+ *	Does a line in file (only the first one starting with prefix, if not
+ *	NULL) contain word, ignoring case?
+ */
+static int
+file_mentions(const char *file, const char *prefix, const char *word)
+{
+    char line[BIGBUFSIZ], *p;
+    int found = FALSE;
+    FILE *fp;
+
+    if ((fp = fopen(file, "r")) == NULL)
+	return FALSE;
+
+    while (!found && fgets(line, sizeof(line), fp) != NULL) {
+	if (prefix != NULL && strncmp(line, prefix, strlen(prefix)) != 0)
+	    continue;
+	for (p = line; *p != '\0'; p++)
+	    *p = tolower(*p);
+	found = strstr(line, word) != NULL;
+	if (prefix != NULL)
+	    break;
+    }
+
+    (void) fclose(fp);
+    return found;
+}
+
+/*
+ *	Does the firmware say that this is a virtual machine?  (Unlike
+ *	/sys/hypervisor/type, which a Xen dom0 has too.)
+ */
+static int
+dmi_virtual(void)
+{
+    static const char *const vendors[] = {
+	"qemu", "kvm", "vmware", "innotek", "xen", "bochs", "parallels",
+	"amazon ec2", NULL
+    };
+    static const char *const products[] = {
+	"virtual machine", "google compute engine", NULL
+    };
+    const char *const *vv;
+
+    for (vv = vendors; *vv != NULL; vv++)
+	if (file_mentions("/sys/class/dmi/id/sys_vendor", NULL, *vv))
+	    return TRUE;
+    for (vv = products; *vv != NULL; vv++)
+	if (file_mentions("/sys/class/dmi/id/product_name", NULL, *vv))
+	    return TRUE;
+
+    return FALSE;
+}
+
+/*
+ *	Add keywords for what we're running in: [ssh], [tty], [container]
+ *	(and [docker] or [podman]), [vm], [wsl], and [systemd].  These are
+ *	all cheap checks of files and the inherited environment, so that
+ *	the environment files don't have to run commands to find out.
+ */
+static void
+add_keyword_context(struct esh *E)
+{
+    struct stat st;
+
+    if (getvar(E, "SSH_CONNECTION") != NULL || getvar(E, "SSH_CLIENT") != NULL)
+	add_keyword(E, "ssh");
+
+    if (isatty(STDIN_FILENO))
+	add_keyword(E, "tty");
+
+    if (access("/.dockerenv", F_OK) == 0) {
+	add_keyword(E, "container");
+	add_keyword(E, "docker");
+    }
+    if (access("/run/.containerenv", F_OK) == 0) {
+	add_keyword(E, "container");
+	add_keyword(E, "podman");
+    }
+    if (file_mentions("/proc/1/cgroup", NULL, "/docker") ||
+	file_mentions("/proc/1/cgroup", NULL, "/kubepods") ||
+	file_mentions("/proc/1/cgroup", NULL, "/lxc"))
+	add_keyword(E, "container");
+
+    if (file_mentions("/proc/sys/kernel/osrelease", NULL, "microsoft"))
+	add_keyword(E, "wsl");
+    else if (file_mentions("/proc/cpuinfo", "flags", " hypervisor") ||
+	     dmi_virtual())
+	add_keyword(E, "vm");
+
+    /* The same test as sd_booted() */
+    if (lstat("/run/systemd/system", &st) == 0 && S_ISDIR(st.st_mode))
+	add_keyword(E, "systemd");
+}
+
+/*
+ *	Add keywords for the features of the CPU that we're running on (not
+ *	the one we were built on), e.g. [avx2] or [sve], and the x86-64
+ *	levels that it supports, e.g. [x86-64-v3].  The levels include the
+ *	ones below, so that sections for them can be given in order with the
+ *	best one last.
+ */
+static void
+add_keyword_cpu(struct esh *E)
+{
+#if defined(__x86_64__)
+    int v2, v3, v4;
+
+    __builtin_cpu_init();
+
+    /* (The builtin only takes constant strings) */
+    if (__builtin_cpu_supports("sse4.2"))
+	add_keyword(E, "sse4_2");
+    if (__builtin_cpu_supports("avx"))
+	add_keyword(E, "avx");
+    if (__builtin_cpu_supports("avx2"))
+	add_keyword(E, "avx2");
+    if (__builtin_cpu_supports("fma"))
+	add_keyword(E, "fma");
+    if (__builtin_cpu_supports("avx512f"))
+	add_keyword(E, "avx512f");
+    if (__builtin_cpu_supports("avx512bw"))
+	add_keyword(E, "avx512bw");
+    if (__builtin_cpu_supports("avx512vl"))
+	add_keyword(E, "avx512vl");
+
+    v2 = __builtin_cpu_supports("popcnt") && __builtin_cpu_supports("ssse3") &&
+	__builtin_cpu_supports("sse4.2");
+    v3 = v2 && __builtin_cpu_supports("avx2") &&
+	__builtin_cpu_supports("bmi2") && __builtin_cpu_supports("fma");
+    v4 = v3 && __builtin_cpu_supports("avx512f") &&
+	__builtin_cpu_supports("avx512bw") &&
+	__builtin_cpu_supports("avx512cd") &&
+	__builtin_cpu_supports("avx512dq") &&
+	__builtin_cpu_supports("avx512vl");
+
+    add_keyword(E, "x86-64-v1");
+    if (v2)
+	add_keyword(E, "x86-64-v2");
+    if (v3)
+	add_keyword(E, "x86-64-v3");
+    if (v4)
+	add_keyword(E, "x86-64-v4");
+#elif defined(__aarch64__) && defined(__linux__)
+    unsigned long hwcap = getauxval(AT_HWCAP);
+
+    if (hwcap & HWCAP_ASIMD) {
+	add_keyword(E, "asimd");
+	add_keyword(E, "neon");
+    }
+    if (hwcap & HWCAP_ATOMICS)
+	add_keyword(E, "atomics");
+#ifdef HWCAP_SVE
+    if (hwcap & HWCAP_SVE)
+	add_keyword(E, "sve");
+#endif
+#ifdef HWCAP2_SVE2
+    if (getauxval(AT_HWCAP2) & HWCAP2_SVE2)
+	add_keyword(E, "sve2");
+#endif
+#endif
+}
+
+/*
+ *	Add the distribution's [<id>] and [<codename>] keywords, those that
+ *	it's like, and [<id>=<version>] from the os-release file.
+ */
+static void
+add_keyword_release(struct esh *E)
+{
+    char line[BIGBUFSIZ], id[256], version[256], *p, *q, *value;
+    FILE *fp;
+
+    if ((fp = fopen("/etc/os-release", "r")) == NULL &&
+	(fp = fopen("/usr/lib/os-release", "r")) == NULL)
+	return;
+
+    *id = *version = '\0';
+    while (fgets(line, sizeof(line), fp) != NULL) {
+	if ((value = strchr(line, '=')) == NULL)
+	    continue;
+	*value++ = '\0';
+
+	/* Unquote the value (which shouldn't need any escapes) */
+	value[strcspn(value, "\n")] = '\0';
+	if ((*value == '"' || *value == '\'') &&
+	    (p = strchr(value + 1, *value)) != NULL) {
+	    *p = '\0';
+	    value++;
+	}
+
+	if (strcmp(line, "ID") == 0) {
+	    snprintf(id, sizeof(id), "%s", value);
+	    add_keyword(E, id);
+	} else if (strcmp(line, "VERSION_ID") == 0) {
+	    snprintf(version, sizeof(version), "%s", value);
+	} else if (strcmp(line, "VERSION_CODENAME") == 0) {
+	    add_keyword(E, value);
+	} else if (strcmp(line, "ID_LIKE") == 0) {
+	    for (p = value; (q = strtok_r(p, " \t", &p)) != NULL; )
+		add_keyword(E, q);
+	}
+    }
+    (void) fclose(fp);
+
+    if (*id != '\0' && *version != '\0') {
+	snprintf(line, sizeof(line), "%s=%s", id, version);
+	add_keyword(E, line);
+    }
+}
+
+/*
+ *	Fill up the keywords array with more words that apply to the given
+ *	user (or ourselves, if NULL).
+ */
+static void
+init_keywords(struct esh *E, const char *user)
+{
+    struct utsname uts;
+    struct passwd pwent, *pw;
+    char pwbuf[BUFSIZ], hostbuf[1024];
+
+    if (user != NULL) {
+	add_keyword(E, user);
+    } else {
+	if (getlogin_r(hostbuf, sizeof(hostbuf)) == 0)
+	    add_keyword(E, hostbuf);
+
+	if (getpwuid_r(getuid(), &pwent, pwbuf, sizeof(pwbuf), &pw) == 0 &&
+	    pw != NULL)
+	    add_keyword(E, pw->pw_name);
+    }
+    add_keyword_groups(E, user);
+
+    if (gethostname(hostbuf, sizeof(hostbuf)) == 0)
+	add_keyword_hostname(E, hostbuf);
+
+    if (uname(&uts) == 0) {
+	/* [<os>], e.g. [Linux] or [Darwin] */
+	add_keyword(E, uts.sysname);
+
+	/* [<nodename>], e.g. [lenux.lan.lovstrand.com] or [neo] */
+	add_keyword_hostname(E, uts.nodename);
+
+	/* [<machine>], e.g. [i686] or [Power Macintosh] */
+	add_keyword(E, uts.machine);
+
+	/* [kernel=<release>], e.g. [kernel=6.1.0-18-amd64] */
+	snprintf(hostbuf, sizeof(hostbuf), "kernel=%s", uts.release);
+	add_keyword(E, hostbuf);
+    }
+
+    add_keyword_release(E);
+
+    add_keyword_cpu(E);
+    add_keyword_context(E);
+}
+
+/*
+ *	Basic '*' and '?' pattern matching
+ */
+static int
+matches(const char *pat, const char *str)
+{
+    for (; *pat != '\0'; pat++) {
+	if (*pat == '*') {
+	    for (pat++;; str++) {
+		if (matches(pat, str))
+		    return TRUE;
+		if (*str == '\0')
+		    return FALSE;
+	    }
+
+	} else if (*pat == '?' && *str != '\0') {
+	    str++;
+
+	} else if (tolower(*pat) == tolower(*str)) {
+	    str++;
+
+	} else {
+	    return FALSE;
+	}
+    }
+
+    return *str == '\0';
+}
+
+/*
+ *	Is n (of len digits, starting with a zero if lead) in one of the
+ *	comma separated ranges from p to end, as in "1-4,7" or "001-480"?
+ *	A range written with leading zeros only takes numbers that wide.
+ */
+static int
+in_ranges(const char *p, const char *end, unsigned long n, int len, int lead)
+{
+    unsigned long lo, hi;
+    char *q;
+    int width;
+
+    while (p < end) {
+	lo = strtoul(p, &q, 10);
+	if (q == p || !isdigit(*p))
+	    return FALSE;
+	width = *p == '0' && q - p > 1 ? q - p : 0;
+	hi = *q == '-' ? strtoul(q + 1, &q, 10) : lo;
+
+	if ((width != 0 ? len == width : !lead || len == 1) &&
+	    lo <= n && n <= hi)
+	    return TRUE;
+
+	if (*q != ',')
+	    break;
+	p = q + 1;
+    }
+
+    return FALSE;
+}
+
+/*
+ *	Hostlist pattern matching: '*' and '?' as usual, plus numeric ranges
+ *	like "web[001-480]" or "node[1-4,7]" and alternatives like "db{a,b}".
+ *	However many hosts a range covers, it takes the same time to check.
+ */
+static int
+hostlist_matches(const char *pat, const char *str)
+{
+    const char *p, *q, *end;
+    unsigned long n;
+    int len;
+
+    for (; *pat != '\0'; pat++) {
+	if (*pat == '*') {
+	    for (pat++;; str++) {
+		if (hostlist_matches(pat, str))
+		    return TRUE;
+		if (*str == '\0')
+		    return FALSE;
+	    }
+
+	} else if (*pat == '[') {
+	    /* Try each run of digits that str starts with */
+	    if ((end = strchr(pat, ']')) == NULL)
+		return FALSE;
+	    for (n = 0, len = 1; isdigit(str[len - 1]); len++) {
+		n = 10 * n + (str[len - 1] - '0');
+		if (in_ranges(pat + 1, end, n, len, *str == '0') &&
+		    hostlist_matches(end + 1, str + len))
+		    return TRUE;
+	    }
+	    return FALSE;
+
+	} else if (*pat == '{') {
+	    /* Try each alternative in turn */
+	    if ((end = strchr(pat, '}')) == NULL)
+		return FALSE;
+	    for (p = pat + 1;; p = q + 1) {
+		if ((q = memchr(p, ',', end - p)) == NULL)
+		    q = end;
+		if (strncasecmp(p, str, q - p) == 0 &&
+		    hostlist_matches(end + 1, str + (q - p)))
+		    return TRUE;
+		if (q == end)
+		    return FALSE;
+	    }
+
+	} else if (*pat == '?' && *str != '\0') {
+	    str++;
+
+	} else if (tolower(*pat) == tolower(*str)) {
+	    str++;
+
+	} else {
+	    return FALSE;
+	}
+    }
+
+    return *str == '\0';
+}
+
+/*
+ *	Does a "[~regex]" conditional match any keyword in full (ignoring
+ *	case)?  Each regex is compiled only once.
+ */
+static int
+regex_conditional(struct esh *E, const char *regex)
+{
+    struct selector *sel;
+    char **kk, *anchored;
+    int i;
+
+    for (i = 0; i < E->nselectors; i++)
+	if (strcmp(E->selectors[i].text, regex) == 0)
+	    break;
+
+    sel = &E->selectors[i];
+    if (i == E->nselectors) {
+	E->selectors = xalloc(E, E->selectors,
+			      (E->nselectors + 1) * sizeof(struct selector));
+	sel = &E->selectors[E->nselectors++];
+	sel->text = newstr(E, regex);
+
+	anchored = xalloc(E, NULL, strlen(regex) + 5);
+	sprintf(anchored, "^(%s)$", regex);
+	sel->ok = regcomp(&sel->re, anchored,
+			  REG_EXTENDED | REG_ICASE | REG_NOSUB) == 0;
+	xfree(E, anchored);
+
+	if (!sel->ok && E->log != NULL)
+	    fprintf(E->log, "Warning: Bad regular expression [~%s] -- ignored\n",
+		    regex);
+    }
+
+    if (sel->ok) {
+	for (kk = E->keywords; *kk != NULL; kk++)
+	    if (regexec(&sel->re, *kk, 0, NULL, 0) == 0)
+		return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*
+ *	Compare two version strings, like strcmp().  Runs of digits compare
+ *	as numbers and other runs alphabetically, while anything else just
+ *	separates them, so "6.10" > "6.9" and "22.04" == "22.4".  A version
+ *	with more to it is the greater one, unless that's just zeros.
+ */
+static int
+vercmp(const char *a, const char *b)
+{
+    int alen, blen, c;
+
+    for (;;) {
+	while (*a != '\0' && !isalnum(*a))
+	    a++;
+	while (*b != '\0' && !isalnum(*b))
+	    b++;
+	if (*a == '\0' || *b == '\0') {
+	    /* Trailing zeros don't count, so that "12" == "12.0" */
+	    a += strspn(a, "0.");
+	    b += strspn(b, "0.");
+	    return (*a != '\0') - (*b != '\0');
+	}
+
+	if (isdigit(*a) && isdigit(*b)) {
+	    while (*a == '0' && isdigit(a[1]))
+		a++;
+	    while (*b == '0' && isdigit(b[1]))
+		b++;
+	    for (alen = 0; isdigit(a[alen]); alen++);
+	    for (blen = 0; isdigit(b[blen]); blen++);
+	    if (alen != blen)
+		return alen - blen;
+	} else if (isdigit(*a) || isdigit(*b)) {
+	    /* Numbers are newer than letters, as with rpm */
+	    return isdigit(*a) ? 1 : -1;
+	} else {
+	    for (alen = 0; isalpha(a[alen]); alen++);
+	    for (blen = 0; isalpha(b[blen]); blen++);
+	}
+
+	if ((c = strncasecmp(a, b, MIN(alen, blen))) != 0)
+	    return c;
+	if (alen != blen)
+	    return alen - blen;
+	a += alen;
+	b += blen;
+    }
+}
+
+/*
+ *	Does a "[name<op>version]" conditional, e.g. [ubuntu>=22.04] or
+ *	[kernel<6.1], hold for the version in the [name=version] keyword?
+ */
+static int
+version_conditional(struct esh *E, const char *name, const char *op)
+{
+    const char *version;
+    char **kk;
+    int len = op - name, c;
+
+    for (kk = E->keywords; *kk != NULL; kk++)
+	if (strncasecmp(*kk, name, len) == 0 && (*kk)[len] == '=')
+	    break;
+    if (*kk == NULL)
+	return FALSE;
+
+    version = op + strspn(op, "<>=!");
+    c = vercmp(*kk + len + 1, version);
+
+    if (strncmp(op, ">=", 2) == 0)
+	return c >= 0;
+    else if (strncmp(op, "<=", 2) == 0)
+	return c <= 0;
+    else if (strncmp(op, "!=", 2) == 0)
+	return c != 0;
+    else if (*op == '>')
+	return c > 0;
+    else if (*op == '<')
+	return c < 0;
+    else
+	return c == 0;
+}
+
+/*
+ *	Determine if a certain "[name]" conditional applies to us.
+ */
+static int
+conditional(struct esh *E, const char *name)
+{
+    const char *op;
+    char **kk;
+
+    /* A regular expression, e.g. [~^gpu-[0-9]+\.prod$]? */
+    if (*name == '~')
+	return regex_conditional(E, name + 1);
+
+    /* A version comparison? */
+    if ((op = strpbrk(name, "<>=!")) != NULL && op > name)
+	return version_conditional(E, name, op);
+
+    /* A hostlist, e.g. [web[001-480]] or [db{a,b,c}*]? */
+    if (strpbrk(name, "[{") != NULL) {
+	for (kk = E->keywords; *kk != NULL; kk++)
+	    if (hostlist_matches(name, *kk))
+		return TRUE;
+	return FALSE;
+    }
+
+    /* A plain word is either there or not */
+    if (strpbrk(name, "*?") == NULL)
+	return *keyword_slot(E, name) != NULL;
+
+    /* try all predefined keywords */
+    for (kk = E->keywords; *kk != NULL; kk++) {
+	if (matches(name, *kk))
+	    return TRUE;
+    }
+
+    /* if all else fails... well, we fail too */
+    return FALSE;
+}
+
+/*
+ *	Is the binding for name (possibly prefixed by markers) one to put
+ *	off until later with a '&'?  Only plain "name value" bindings can be.
+ */
+static int
+deferrable(const char *name)
+{
+    const char *p;
+    int marked = FALSE;
+
+    for (p = name; *p == '!' || *p == '%' || *p == '&'; p++)
+	if (*p == '&')
+	    marked = TRUE;
+
+    if (!marked || !(isalpha(*p) || *p == '_'))
+	return FALSE;
+    while (isalnum(*p) || *p == '_')
+	p++;
+
+    return *p == '\0' || *p == '=';
+}
+
+/*
+ *	Should the binding for name (possibly prefixed by '!', '%', and '&'
+ *	markers) be skipped?  A '%' marks it as only being meant for
+ *	interactive sessions.
+ */
+static int
+skipped(struct esh *E, const char *name)
+{
+    const char *p;
+    int marked = FALSE;
+
+    for (p = name; *p == '!' || *p == '%' || *p == '&'; p++)
+	if (*p == '%')
+	    marked = TRUE;
+
+#ifdef DISABLE_NONINTERACTIVE_PS1
+    if (strncmp(p, "PS1", 3) == 0 && (p[3] == '\0' || p[3] == '='))
+	marked = TRUE;
+#endif
+
+    return marked && !conditional(E, "interactive");
+}
+
+static int
+auto_prune_paths(struct esh *E)
+{
+    return E->autoprune || (lookup(E, AUTO_PRUNE_VAR) != NULL);
+}
+
+/*
+ *	Run a section selector command or [...] test and return its exit code.
+ *	A command that is prefixed by '=' is considered to be constant.
+ */
+static int
+section_exec(struct esh *E, char *cmd)
+{
+    if (*cmd == '=')
+	cmd++;
+    else
+	nosnapshot(E, cmd);
+
+    /* The command should see the current value of any path lists */
+    pathflush(E, NULL, FALSE);
+
+    return run(E, cmd, NULL, 0);
+}
+
+/*
+ *	Read a binding from the stream and return it in the form "name=value".
+ *	The format of the file is: name<whitespace>value<newline> with
+ *	special processing for #, $, \.
+ *
+ *	Example:
+ *		" name [=] value\"
+ *		"	\#value\$value # comment"
+ *		=> "name=value#value$value"
+ */
+static char *
+readbinding(struct esh *E, FILE *stream)
+{
+    char *p, *q, *b, buf[BIGBUFSIZ];
+    char *name, *value;
+    char listop = '\0';
+    int pathp = FALSE;
+    int ignore = FALSE;
+    int comment_level, new_comment_level = 0;
+    int braces;
+    char in_quote = '\0', line_quote;
+    long offset = -1;
+    int indexed;
+
+    name = value = NULL;
+    b = buf;
+    for (;;) {
+	if (E->index != NULL)
+	    offset = ftell(stream);
+	if (fgets(b, buf + sizeof(buf) - b, stream) == NULL)
+	    break;
+	comment_level = new_comment_level;
+	line_quote = in_quote;
+
+	/* find newline and nuke it */
+	p = strchr(b, '\n');
+	if (p == NULL) {
+	    if (E->log != NULL)
+		fprintf(E->log,
+			"Warning: Line too long -- truncated after %d chars\n",
+			(int) sizeof(buf)-1);
+	} else
+	    *p = '\0';
+
+	/* find unquoted sharp (#) and nuke rest of line (but ${#foo} and
+	 * ${foo#pat} aren't comments)
+	 */
+	for (braces = 0, p = b; *p != '\0'; p++) {
+	    if (*p == '\\' && p[1] != '\0')
+		p++;
+	    else if (*p == in_quote)
+		in_quote = '\0';
+	    else if (in_quote == '\0') {
+		if (*p == '\'' || *p == '"')
+		    in_quote = *p;
+		else if (*p == '$' && p[1] == '{')
+		    braces++, p++;
+		else if (*p == '}' && braces > 0)
+		    braces--;
+		else if (*p == '#' && braces == 0) {
+		    if (p[1] == '<')
+			new_comment_level = comment_level + 1;
+		    else if (p[1] == '>')
+			new_comment_level = comment_level - 1;
+		    break;
+		}
+	    }
+	}
+
+	/* nuke all trailing spaces */
+	while (p > b && isspace(p[-1]) && (p == b + 1 || p[-2] != '\\'))
+	    p--;
+	*p = '\0';
+
+	/* are we in a #<...#> multiline block? */
+	if (comment_level > 0)
+	    continue;
+
+	p = b;
+	/* skip leading spaces */
+	while (*p != '\0' && isspace(*p))
+	    p++;
+	if (*p == '\0')
+	    continue;
+
+	/* Keep track of where the sections are, for next time */
+	indexed = name == NULL && b == buf && line_quote == '\0' && offset >= 0;
+	if (*p == '[' && E->index != NULL && E->index->recording) {
+	    if (indexed)
+		index_add(E, offset, p);
+	    else
+		E->index->bad = TRUE;
+	}
+
+	/* Is it a conditional "[name]" section? */
+	if (*p == '[') {
+	    char *n, name[1024];
+	    char endexec = '\0';
+	    int inexec = FALSE;
+	    int intest = FALSE;
+	    int parens = 0;
+	    int brackets = 0;
+
+	    /* Scan forward looking for a possible trailing '_' binding */
+	    n = strrchr(p, ']');
+	    if (n != NULL) {
+		for (n++; *n != '\0' && isspace(*n); n++);
+		if (*n != '\0')
+		    editenv(E, OP_REPLACE, mkbind(E, "_", interpret(E, n, FALSE)));
+	    }
+
+	    /* Assume that we will ignore this section */
+	    ignore = TRUE;
+
+	    for (n = name, p++; *p != '\0'; p++) {
+		if (!inexec && !intest && brackets == 0 &&
+		    (isspace(*p) || *p == ']')) {
+		    /* Simple keyword, check if it's enabled */
+		    *n = '\0';
+		    if (ignore && n > name && conditional(E, name)) {
+			ignore = FALSE;
+			break;
+		    }
+		    n = name;
+
+		} else if (*p == endexec && parens == 0) {
+		    /* It's the end of a `...` or $(...) expression.
+		     * Send it to the shell and see what exit code we get.
+		     */
+		    *n = '\0';
+		    if (ignore && section_exec(E, name) == 0) {
+			ignore = FALSE;
+			break;
+		    }
+		    n = name;
+		    inexec = FALSE;
+
+		} else if (!inexec && !intest && n > name &&
+			   (*p == '[' || *p == ']')) {
+		    /* A range in a hostlist or a class in a regex */
+		    brackets += *p == '[' ? 1 : -1;
+		    if (n < &name[sizeof(name)-1])
+			*n++ = *p;
+		    continue;
+
+		} else if (!intest && *p == '[') {
+		    /* The start of a [...] test (q.v.) */
+		    intest = TRUE;
+		    *n++ = '[';
+		    *n++ = ' ';
+
+		} else if (intest && *p == ']') {
+		    /* The end of a [...] test */
+		    if (n < &name[sizeof(name)-2]) {
+			*n++ = ' ';
+			*n++ = ']';
+		    }
+		    *n = '\0';
+		    if (E->debug)
+			fprintf(E->log, "# test: %s\n", name);
+		    if (ignore && section_exec(E, name) == 0) {
+			ignore = FALSE;
+			break;
+		    }
+		    n = name;
+		    intest = FALSE;
+
+		} else if (!inexec && !intest && *p == '`') {
+		    /* The start of a `...` expression. */
+		    inexec = TRUE;
+		    endexec = *p;
+
+		} else if (!inexec && !intest && *p == '$' && p[1] == '(') {
+		    /* The start of a $(...) expression */
+		    p++;
+		    inexec = TRUE;
+		    endexec = ')';
+
+		} else if (n < &name[sizeof(name)-1]) {
+		    /* Inside of something, keep copying it to the name buf */
+		    *n++ = *p;
+
+		    if (inexec) {
+			if (*p == '(')
+			    parens++;
+			else if (*p == ')')
+			    parens--;
+		    }
+		}
+
+		if (*p == ']')
+		    break;
+	    }
+
+	    /* Go straight on to the next section that might apply */
+	    if (ignore && E->index != NULL && !E->index->recording &&
+		indexed && index_skip(E, stream, offset)) {
+		new_comment_level = 0;
+		in_quote = '\0';
+	    }
+	    continue;
+	}
+
+	/* Ignore all bindings within a dissatisfied section */
+	if (ignore)
+	    continue;
+
+	/* Is it a "< file" import? */
+	if (name == NULL && *p == '<') {
+	    for (p++; *p != '\0' && isspace(*p); p++);
+	    p = interpret(E, p, FALSE);
+	    name = xalloc(E, NULL, strlen(p) + 2);
+	    sprintf(name, "<%s", p);
+	    return name;
+	}
+
+	/* Is it a "use module ..." line? */
+	if (name == NULL && strncmp(p, "use", 3) == 0 && isspace(p[3])) {
+	    p = interpret(E, p + 4, FALSE);
+	    name = xalloc(E, NULL, strlen(p) + 2);
+	    sprintf(name, "@%s", p);
+	    return name;
+	}
+
+	/* got a name already? */
+	if (name == NULL) {
+	    /* find beginning of name */
+	    name = p;
+
+	    /* find end of name */
+	    while (*p != '\0' && !isspace(*p) && *p != '=')
+		p++;
+	    if (*p == '\0')
+		return mkbind(E, name, "");
+
+	    if (*p == '=' && p > name + 1 && (p[-1] == '+' || p[-1] == '-')) {
+		/* "name+=value" or "name-=value" */
+		listop = p[-1];
+		p[-1] = '\0';
+		p++;
+	    } else {
+		*p++ = '\0';
+
+		/* "name += value", "name =+ value", or "name -= value"? */
+		for (q = p; *q != '\0' && isspace(*q); q++);
+		if (((q[0] == '+' || q[0] == '-') && q[1] == '=') ||
+		    (q[0] == '=' && q[1] == '+')) {
+		    if (q[2] == '\0' || isspace(q[2])) {
+			listop = q[0] == '=' ? '^' : q[0];
+			p = q + 2;
+		    }
+		}
+	    }
+
+	    /* is this a path variable? */
+	    if (listop == '\0' && auto_prune_paths(E) &&
+		strlen(name) >= 4 && strcmp(name + strlen(name) - 4, "PATH") == 0)
+		pathp = TRUE;
+	    b = p;
+	}
+
+	/* find beginning of value */
+	while (*p != '\0' && isspace(*p))
+	    p++;
+
+	/* compact buffer if necessary */
+	if (p > b) {
+	    memmove(b, p, strlen(p) + 1);
+	    p = b;
+	}
+
+	if (value == NULL)
+	    value = p;
+
+	/* empty/end of value? */
+	if (*p == '\0')
+	    break;
+
+	/* check end of value */
+	p += strlen(p);
+	if (p == value || p[-1] != '\\')
+	    break;
+
+	/* handle continuation */
+	*--p = '\0';
+	b = p;
+    }
+
+    if (name == NULL)
+	return NULL;
+
+    if (skipped(E, name)) {
+	/* Leave it to readenv() to skip without even evaluating it */
+	return mkbind(E, name, "");
+    } else if (listop == '\0' && deferrable(name)) {
+	/* Leave it to be interpreted later on (see esh_deferred()) */
+	return mkbind(E, name, value);
+    } else if (listop != '\0') {
+	/* Leave the list editing to readenv(), e.g. "PATH+=/usr/X11/bin" */
+	char *val = interpret(E, value, TRUE);
+	char *bind = xalloc(E, NULL, strlen(name) + 2 + strlen(val) + 1);
+
+	sprintf(bind, "%s%c=%s", name, listop, val);
+	return bind;
+    } else if (pathp) {
+	return prune(E, name, interpret(E, value, TRUE));
+    } else {
+	return mkbind(E, name, interpret(E, value, FALSE));
+    }
+}
+
+/*
+ *	Interpret the given string with respect to variables etc.
+ *	(Result is a string shared with the next call)
+ */
+static char *
+interpret(struct esh *E, const char *string, int pathcompress)
+{
+    char *tmp = E->tmp;
+    char *buf = E->buf;
+    char *p, *q;
+
+    if (string == NULL)
+	return NULL;
+
+    (void) snprintf(tmp, BIGBUFSIZ, "%s", string);
+    p = tmp;
+    q = buf;
+
+    while (*p != '\0' && q < &buf[BIGBUFSIZ] - 1) {
+	char *oq = q;
+
+	switch (*p++) {
+	  case '~':
+	    tilde(E, &p, &q, &buf[BIGBUFSIZ] - q);
+	    break;
+
+	  case '$':
+	    if (*p != '(' || p[1] == '(') {
+		expand(E, &p, &q, &buf[BIGBUFSIZ] - q);
+		if (pathcompress && q == oq) {
+		    /* Don't let an empty expansion lead to an empty
+		     * path component being created.
+		     */
+		    if (q > buf && q[-1] == ':' && *p == '\0')
+			q--;
+		    else if ((q == buf || q[-1] == ':') && *p == ':')
+			p++;
+		}
+		break;
+	    }
+	    // FALL_THROUGH
+
+	  case '`':
+	    p--;
+	    compute(E, &p, &q, &buf[BIGBUFSIZ] - q);
+	    if (pathcompress && q == oq) {
+		/* Don't let an empty expansion lead to an empty
+		 * path component being created.
+		 */
+		if (q > buf && q[-1] == ':' && *p == '\0')
+		    q--;
+		else if ((q == buf || q[-1] == ':') && *p == ':')
+		    p++;
+	    }
+	    break;
+	  case '\\':
+	    switch (*p) {
+	      case 'n': *q++ = '\n'; break;
+	      case 'r': *q++ = '\r'; break;
+	      case 't': *q++ = '\t'; break;
+	      default:
+		if (isdigit(*p))
+		    *q++ = strtol(p, &p, 8);
+		else
+		    *q++ = *p++;
+	    }
+	    break;
+	  default:
+	    *q++ = *(p-1);
+	    break;
+	}
+    }
+    *q = '\0';
+
+    return buf;
+}
+
+/*
+ *	Expand ~user to their home directory
+ *	(or leave as-is if the user is unknown).
+ */
+
+static void
+tilde(struct esh *E, char **src, char **dst, int dstlen)
+{
+    char *p = *src;
+    struct passwd pwent, *pw = NULL;
+    char pwbuf[BUFSIZ];
+
+    /* Scan username */
+    while (isalnum(*p) || *p == '_' || *p == '-' || *p == '.') p++;
+
+    if (*p == **src) {
+	(void) getpwuid_r(getuid(), &pwent, pwbuf, sizeof(pwbuf), &pw);
+    } else {
+	int len = p - *src;
+	char tmp[len + 1];
+	memcpy(tmp, *src, len);
+	tmp[len] = '\0';
+	(void) getpwnam_r(tmp, &pwent, pwbuf, sizeof(pwbuf), &pw);
+    }
+
+    if (pw == NULL) {
+	if (dstlen > 0)
+	    *(*dst++) = '~';
+	p = *src;
+    } else {
+	int len = strlen(pw->pw_dir);
+
+	if (len > dstlen)
+	    len = dstlen;
+
+	memcpy(*dst, pw->pw_dir, len);
+
+	*dst += len;
+    }
+
+    *src = p;
+}
+
+/*
+ *	Parse and expand the given variable that src points to and
+ *	copy the result into dst.  Update both src and dst pointers.
+ *	Eg. expand("$foo/baz", "xxxxxxxx", 8) with environ = {"foo=bar", NULL}
+ *	would give "$foo/baz", "barxxxxx"
+ *	      with      ^=src      ^=dst
+ *
+ *	Besides $foo and ${foo}, this handles the usual shell operations:
+ *	${foo-x}, ${foo:-x}, ${foo+x}, ${foo:+x}, ${foo#pat}, ${foo##pat},
+ *	${foo%pat}, ${foo%%pat}, ${foo/pat/rep}, ${foo//pat/rep}, ${foo^},
+ *	${foo^^}, ${foo,}, ${foo,,}, ${#foo}, and $((arithmetic)).
+ */
+static void
+expand(struct esh *E, char **src, char **dst, int dstlen)
+{
+    char name[256], val[BIGBUFSIZ], word[BIGBUFSIZ], *p = *src, *w, *rep;
+    char open, close, op, *value;
+    int len, depth = 0, colon = FALSE, twice;
+
+    if (p[0] == '(' && p[1] == '(') {
+	arithmetic(E, src, dst, dstlen);
+	return;
+    }
+
+    if (*p != '{' && *p != '(') {
+	/* Plain $foo */
+	for (len = 0; (isalnum(*p) || *p == '_') && len < (int) sizeof(name) - 1;)
+	    name[len++] = *p++;
+	name[len] = '\0';
+	*src = p;
+	copyout(lookup(E, name), dst, dstlen);
+	return;
+    }
+
+    open = *p++;
+    close = open == '{' ? '}' : ')';
+    if (*p == '#' && (isalnum(p[1]) || p[1] == '_')) {
+	/* ${#foo} */
+	p++;
+	for (len = 0; (isalnum(*p) || *p == '_') && len < (int) sizeof(name) - 1;)
+	    name[len++] = *p++;
+	name[len] = '\0';
+	value = lookup(E, name);
+	snprintf(val, sizeof(val), "%d", value != NULL ? (int) strlen(value) : 0);
+	while (*p != '\0' && *p++ != close);
+	*src = p;
+	copyout(val, dst, dstlen);
+	return;
+    }
+
+    for (len = 0; (isalnum(*p) || *p == '_') && len < (int) sizeof(name) - 1;)
+	name[len++] = *p++;
+    name[len] = '\0';
+    value = lookup(E, name);
+
+    /* The operation and its word(s) go on until the matching close */
+    op = *p;
+    if (op == ':' && (p[1] == '-' || p[1] == '+')) {
+	colon = TRUE;
+	op = *++p;
+    }
+    if (op != close && op != '\0')
+	p++;
+    twice = (op == '#' || op == '%' || op == '/' || op == '^' || op == ',') &&
+	*p == op;
+    if (twice)
+	p++;
+    for (w = p; *w != '\0'; w++) {
+	if (*w == '\\' && w[1] != '\0')
+	    w++;
+	else if (*w == open)
+	    depth++;
+	else if (*w == close && depth-- == 0)
+	    break;
+    }
+    len = w - p;
+    *src = *w != '\0' ? w + 1 : w;
+
+    if (value != NULL)
+	snprintf(val, sizeof(val), "%s", value);
+    else
+	val[0] = '\0';
+
+    switch (op) {
+      case '}':
+      case ')':
+      case '\0':
+	break;
+
+      case '+':
+	if (value != NULL && (!colon || *value != '\0')) {
+	    expand_word(E, p, len, FALSE, word, sizeof(word));
+	    copyout(word, dst, dstlen);
+	}
+	return;
+
+      case '#':
+      case '%':
+	expand_word(E, p, len, TRUE, word, sizeof(word));
+	trim(val, word, op == '#', twice);
+	break;
+
+      case '/':
+	/* ${foo/pat/rep}, maybe anchored as ${foo/#pat/rep} or ${foo/%pat/rep} */
+	if (!twice && (*p == '#' || *p == '%')) {
+	    op = *p++;
+	    len--;
+	}
+	for (rep = p; rep < p + len && *rep != '/'; rep++)
+	    if (*rep == '\\' && rep + 1 < p + len)
+		rep++;
+	expand_word(E, p, rep - p, TRUE, word, sizeof(word));
+	if (rep < p + len)
+	    rep++;
+	replace(E, val, word, rep, p + len - rep, op, twice);
+	break;
+
+      case '^':
+      case ',':
+	for (w = val; *w != '\0' && (twice || w == val); w++)
+	    *w = op == '^' ? toupper(*w) : tolower(*w);
+	break;
+
+      default:
+	/* ${foo-x}, ${foo:-x}, and anything else (like it always has been) */
+	if (value == NULL || (colon && *value == '\0'))
+	    expand_word(E, p, len, FALSE, val, sizeof(val));
+	break;
+    }
+
+    copyout(val, dst, dstlen);
+}
+
+/*
+ *	Copy value (if any) to dst, as far as there is room.
+ */
+static void
+copyout(const char *value, char **dst, int dstlen)
+{
+    char *q = *dst;
+
+    if (value != NULL)
+	while (*value != '\0' && dstlen-- > 0)
+	    *q++ = *value++;
+    *dst = q;
+}
+
+/*
+ *	Expand the len chars of word that an operation takes (like the x in
+ *	${foo:-x}) into out.  Backslashes are kept in patterns, for fnmatch().
+ */
+static void
+expand_word(struct esh *E, const char *word, int len, int pattern, char *out,
+	    int outlen)
+{
+    char buf[BIGBUFSIZ], *p = buf, *q = out, *end = out + outlen - 1;
+
+    snprintf(buf, sizeof(buf), "%.*s", len, word);
+    while (*p != '\0' && q < end) {
+	if (*p == '\\' && p[1] != '\0') {
+	    if (pattern)
+		*q++ = *p;
+	    p++;
+	    if (q < end)
+		*q++ = *p++;
+	} else if (*p == '~' && p == buf) {
+	    p++;
+	    tilde(E, &p, &q, end - q);
+	} else if ((*p == '$' && p[1] == '(' && p[2] != '(') || *p == '`') {
+	    compute(E, &p, &q, end - q);
+	} else if (*p == '$') {
+	    p++;
+	    expand(E, &p, &q, end - q);
+	} else
+	    *q++ = *p++;
+    }
+    *q = '\0';
+}
+
+/*
+ *	Remove the shortest (or longest) prefix (or suffix) that matches pat.
+ */
+static void
+trim(char *val, const char *pat, int prefix, int longest)
+{
+    int len = strlen(val), i, n;
+    char c;
+
+    for (n = 0; n <= len; n++) {
+	/* Try the lengths in order of preference */
+	i = longest ? len - n : n;
+	if (prefix) {
+	    c = val[i];
+	    val[i] = '\0';
+	    if (fnmatch(pat, val, 0) == 0) {
+		val[i] = c;
+		memmove(val, val + i, len - i + 1);
+		return;
+	    }
+	    val[i] = c;
+	} else if (fnmatch(pat, val + len - i, 0) == 0) {
+	    val[len - i] = '\0';
+	    return;
+	}
+    }
+}
+
+/*
+ *	Replace the first (or every) longest match of pat in val with the
+ *	(expanded) rep, or only a match at the start ('#') or end ('%').
+ */
+static void
+replace(struct esh *E, char *val, const char *pat, const char *rep, int replen,
+	int anchor, int all)
+{
+    char out[BIGBUFSIZ], with[BIGBUFSIZ], *q = out, *end = &out[sizeof(out) - 1];
+    int len = strlen(val), s, e, matched = FALSE;
+    char c;
+
+    expand_word(E, rep, replen, FALSE, with, sizeof(with));
+
+    for (s = 0; s < len && q < end; ) {
+	e = -1;
+	if ((anchor != '#' || s == 0) && (!matched || all)) {
+	    for (e = len; e > s; e--) {
+		c = val[e];
+		val[e] = '\0';
+		if (fnmatch(pat, val + s, 0) == 0) {
+		    val[e] = c;
+		    break;
+		}
+		val[e] = c;
+		if (anchor == '%')
+		    e = s;		/* only the whole rest will do */
+	    }
+	}
+	if (e > s) {
+	    copyout(with, &q, end - q);
+	    s = e;
+	    matched = TRUE;
+	} else
+	    *q++ = val[s++];
+    }
+    *q = '\0';
+    strcpy(val, out);
+}
+
+/*
+ *	Evaluate $((expression)) with the usual C operators (on integers) and
+ *	variables, with or without a $ in front.
+ */
+static void
+arithmetic(struct esh *E, char **src, char **dst, int dstlen)
+{
+    char expr[BIGBUFSIZ], result[32], *p = *src + 2, *e;
+    const char *ep = expr;
+    int depth = 0;
+    long long value;
+
+    for (e = p; *e != '\0'; e++) {
+	if (*e == '(')
+	    depth++;
+	else if (*e == ')' && depth-- == 0)
+	    break;
+    }
+    *src = e + (*e == ')') + (e[0] == ')' && e[1] == ')');
+
+    expand_word(E, p, e - p, FALSE, expr, sizeof(expr));
+    value = arith_binary(E, &ep, 0);
+    while (isspace(*ep))
+	ep++;
+    if (*ep != '\0' && E->log != NULL)
+	fprintf(E->log, "esh: bad arithmetic at \"%s\" in %s\n", ep, expr);
+
+    snprintf(result, sizeof(result), "%lld", value);
+    copyout(result, dst, dstlen);
+}
+
+/*
+ *	The operators of each precedence level, from lowest to highest.
+ */
+static const char *const ArithOps[][7] = {
+    {"||"},
+    {"&&"},
+    {"|"},
+    {"^"},
+    {"&"},
+    {"==", "!="},
+    {"<=", ">=", "<<", ">>", "<", ">"},
+    {"+", "-"},
+    {"*", "/", "%"},
+};
+#define NARITHLEVELS	(sizeof(ArithOps) / sizeof(ArithOps[0]))
+
+static long long
+arith_binary(struct esh *E, const char **pp, int level)
+{
+    const char *const *op;
+    long long x, y;
+    int len;
+
+    if (level == NARITHLEVELS)
+	return arith_unary(E, pp);
+
+    x = arith_binary(E, pp, level + 1);
+    for (;;) {
+	while (isspace(**pp))
+	    (*pp)++;
+	for (op = ArithOps[level]; *op != NULL; op++) {
+	    len = strlen(*op);
+	    /* Don't take the | of || or the & of && */
+	    if (strncmp(*pp, *op, len) == 0 &&
+		!(len == 1 && strchr("|&<>", **op) && (*pp)[1] == **op))
+		break;
+	}
+	if (*op == NULL)
+	    return x;
+
+	*pp += len;
+	y = arith_binary(E, pp, level + 1);
+	switch ((*op)[0] << 8 | (*op)[1]) {
+	  case '|' << 8 | '|': x = x || y; break;
+	  case '&' << 8 | '&': x = x && y; break;
+	  case '|' << 8: x |= y; break;
+	  case '^' << 8: x ^= y; break;
+	  case '&' << 8: x &= y; break;
+	  case '=' << 8 | '=': x = x == y; break;
+	  case '!' << 8 | '=': x = x != y; break;
+	  case '<' << 8 | '=': x = x <= y; break;
+	  case '>' << 8 | '=': x = x >= y; break;
+	  case '<' << 8 | '<':
+	  case '>' << 8 | '>':
+	    if (y < 0 || y >= 64) {
+		if (E->log != NULL)
+		    fprintf(E->log, "esh: shift count out of range\n");
+		x = 0;
+	    } else if ((*op)[0] == '<')
+		x = (long long) ((unsigned long long) x << y);
+	    else
+		x >>= y;
+	    break;
+	  case '<' << 8: x = x < y; break;
+	  case '>' << 8: x = x > y; break;
+	  /* Wrap around on overflow, as the shell does */
+	  case '+' << 8: x = (long long) ((unsigned long long) x + y); break;
+	  case '-' << 8: x = (long long) ((unsigned long long) x - y); break;
+	  case '*' << 8: x = (long long) ((unsigned long long) x * y); break;
+	  case '/' << 8:
+	  case '%' << 8:
+	    if (y == 0) {
+		if (E->log != NULL)
+		    fprintf(E->log, "esh: division by zero\n");
+		x = 0;
+	    } else if (y == -1) {
+		/* LLONG_MIN / -1 would trap */
+		x = (*op)[0] == '/' ? (long long) -(unsigned long long) x : 0;
+	    } else
+		x = (*op)[0] == '/' ? x / y : x % y;
+	    break;
+	}
+    }
+}
+
+static long long
+arith_unary(struct esh *E, const char **pp)
+{
+    char name[256], *end;
+    const char *value;
+    long long x = 0;
+    int len = 0;
+
+    while (isspace(**pp))
+	(*pp)++;
+
+    switch (**pp) {
+      case '-':
+	(*pp)++;
+	return (long long) -(unsigned long long) arith_unary(E, pp);
+      case '+': (*pp)++; return arith_unary(E, pp);
+      case '!': (*pp)++; return !arith_unary(E, pp);
+      case '~': (*pp)++; return ~arith_unary(E, pp);
+      case '(':
+	(*pp)++;
+	x = arith_binary(E, pp, 0);
+	while (isspace(**pp))
+	    (*pp)++;
+	if (**pp == ')')
+	    (*pp)++;
+	return x;
+    }
+
+    if (isdigit(**pp)) {
+	x = strtoll(*pp, &end, 0);
+	*pp = end;
+    } else if (isalpha(**pp) || **pp == '_') {
+	while ((isalnum(**pp) || **pp == '_') && len < (int) sizeof(name) - 1)
+	    name[len++] = *(*pp)++;
+	name[len] = '\0';
+	if ((value = lookup(E, name)) != NULL)
+	    x = strtoll(value, NULL, 0);
+    }
+
+    return x;
+}
+
+/*
+ *	Parse and compute the given command by running it through a pipe and
+ *	picking up the result.  Will update both src and dst pointers.
+ *	Eg. compute("`arch`/foo", "xxxxxxxx", 8)
+ *	would give  "`arch`/foo", "sun4xxxx"
+ *	      with         ^=src       ^=dst
+ */
+static void
+compute(struct esh *E, char **srcp, char **dstp, int dstlen)
+{
+    char *src = *srcp;
+    char *dst = *dstp;
+    char *p = NULL, delim;
+    int share;
+
+    if (src[0] == '$' && src[1] == '(') {
+	// $(...)
+	int parens = 1;
+	src += 2;
+	for (p = src; *p != '\0'; p++) {
+	    if (*p == '(') {
+		parens++;
+	    } else if (*p == ')') {
+		parens--;
+		if (parens == 0)
+		    break;
+	    }
+	}
+    } else if (*src == '`') {
+	// `...`
+	p = strchr(++src, '`');
+    }
+
+    if (p == NULL)
+	p = src + strlen(src);
+
+    delim = *p;
+    *p = '\0';
+
+    /* Ignore errors if the command is prefixed by '?' and treat its output
+     * as constant (i.e. cacheable) if it's prefixed by '='.
+     */
+    int ignore_errors = FALSE;
+    int constant = FALSE;
+
+    for (;; src++) {
+	if (*src == '?')
+	    ignore_errors = TRUE;
+	else if (*src == '=')
+	    constant = TRUE;
+	else
+	    break;
+    }
+
+    /* $(<file) doesn't need a shell (or a cat) */
+    if (*src == '<' && readfile(E, src + 1, dst, dstlen, ignore_errors)) {
+	*p = delim;
+	if (delim != '\0')
+	    p++;
+	*srcp = p;
+	*dstp = dst + strlen(dst);
+	return;
+    }
+
+    if (!constant)
+	nosnapshot(E, src);
+
+    /* The command should see the current value of any path lists */
+    pathflush(E, NULL, FALSE);
+
+    if ((share = share_begin(E, src, dst, dstlen)) == SHARE_HIT) {
+	/* Somebody else just ran it for us */
+	E->hits++;
+    } else {
+	if (run(E, src, dst, dstlen) < 0) {
+	    if (!ignore_errors && E->log != NULL)
+		fprintf(E->log, "%s: %s\n", src, strerror(errno));
+	    *dst = '\0';
+	}
+	/* Even if it failed, so that the others won't all try it again */
+	share_end(E, share, src, dst);
+    }
+
+    *p = delim;
+    if (delim != '\0')
+	p++;
+
+    *srcp = p;
+    dst += strlen(dst);
+    *dstp = dst;
+}
+
+/*
+ *	Read the first line of a file for $(<path), much like compute() would
+ *	have gotten from the shell.  Returns FALSE if the path is anything
+ *	more than ~ and variables, and needs the shell after all.
+ */
+static int
+readfile(struct esh *E, char *src, char *dst, int dstlen, int ignore_errors)
+{
+    char path[MAXPATHLEN], *end = &path[sizeof(path) - 1], *p, *q = path;
+    FILE *stream;
+
+    while (*src != '\0' && isspace(*src))
+	src++;
+    for (p = src + strlen(src); p > src && isspace(p[-1]); )
+	*--p = '\0';
+    if (*src == '\0' || strpbrk(src, "`\"'\\*?[|;&<>() \t") != NULL)
+	return FALSE;
+
+    for (p = src; *p != '\0' && q < end; ) {
+	if (*p == '~' && p == src) {
+	    p++;
+	    tilde(E, &p, &q, end - q);
+	} else if (*p == '$') {
+	    p++;
+	    expand(E, &p, &q, end - q);
+	} else
+	    *q++ = *p++;
+    }
+    *q = '\0';
+
+    if ((stream = home_fopen(E, path)) == NULL) {
+	if (!ignore_errors && E->log != NULL)
+	    fprintf(E->log, "%s: %s\n", path, strerror(errno));
+	*dst = '\0';
+    } else {
+	if (fgets(dst, dstlen, stream) == NULL)
+	    *dst = '\0';
+	if ((p = strchr(dst, '\n')) != NULL)
+	    *p = '\0';
+	(void) fclose(stream);
+    }
+
+    /* Unlike a command, a file can be checked for changes */
+    depend_file(E, path);
+    return TRUE;
+}
+
+/*
+ *	Expand $VAR, ${VAR}, ${VAR:-default}, or ${VAR:+alternate} (with p
+ *	just past the $) into *dstp for an imported value.
+ */
+static const char *
+import_var(struct esh *E, const char *p, char **dstp, char *end)
+{
+    const char *value, *alt = NULL;
+    char name[256], op = '\0';
+    int n = 0, brace = *p == '{', altlen = 0;
+
+    if (brace)
+	p++;
+    while ((isalnum(*p) || *p == '_') && n < (int) sizeof(name) - 1)
+	name[n++] = *p++;
+    name[n] = '\0';
+    value = lookup(E, name);
+
+    if (brace) {
+	if (p[0] == ':' && (p[1] == '-' || p[1] == '+')) {
+	    op = p[1];
+	    alt = p += 2;
+	}
+	while (*p != '\0' && *p != '}')
+	    p++;
+	altlen = alt != NULL ? p - alt : 0;
+	if (*p == '}')
+	    p++;
+    }
+
+    if (op == '-' && (value == NULL || *value == '\0'))
+	value = NULL;
+    else if (op == '+')
+	value = value != NULL && *value != '\0' ? NULL : "";
+    else {
+	alt = NULL;
+	altlen = 0;
+    }
+
+    if (value == NULL) {
+	if (altlen > end - *dstp)
+	    altlen = end - *dstp;
+	memcpy(*dstp, alt, altlen);
+	*dstp += altlen;
+    } else {
+	while (*value != '\0' && *dstp < end)
+	    *(*dstp)++ = *value++;
+    }
+
+    return p;
+}
+
+/*
+ *	Unquote (and expand) an imported value the way systemd does: nothing
+ *	in single quotes is special, while bare and double quoted values may
+ *	have variables and backslash escapes.
+ */
+static void
+import_value(struct esh *E, const char *p, char *dst, int dstlen)
+{
+    char *q = dst, *end = dst + dstlen - 1;
+    char quote = '\0';
+
+    while (*p != '\0' && q < end) {
+	if (quote != '\'' && *p == '\\' && p[1] != '\0') {
+	    *q++ = p[1];
+	    p += 2;
+	} else if (quote == '\0' && (*p == '"' || *p == '\'')) {
+	    quote = *p++;
+	} else if (quote != '\0' && *p == quote) {
+	    quote = '\0';
+	    p++;
+	} else if (quote != '\'' && *p == '$' &&
+		   (isalpha(p[1]) || p[1] == '_' || p[1] == '{')) {
+	    p = import_var(E, p + 1, &q, end);
+	} else
+	    *q++ = *p++;
+    }
+    *q = '\0';
+}
+
+/*
+ *	Merge a file of KEY=VALUE lines (with # comments and an optional
+ *	"export " in front) into our environment.
+ */
+static void
+import_file(struct esh *E, const char *file)
+{
+    char line[BIGBUFSIZ], value[BIGBUFSIZ], *name, *p;
+    FILE *stream;
+
+    if ((stream = home_fopen(E, file)) == NULL) {
+	if (E->log != NULL)
+	    fprintf(E->log, "%s: %s\n", file, strerror(errno));
+	return;
+    }
+
+    while (fgets(line, sizeof(line), stream) != NULL) {
+	for (p = line + strlen(line); p > line && isspace(p[-1]); )
+	    *--p = '\0';
+	for (p = line; *p != '\0' && isspace(*p); p++);
+	if (*p == '\0' || *p == '#' || *p == ';')
+	    continue;
+	if (strncmp(p, "export", 6) == 0 && isspace(p[6]))
+	    for (p += 6; isspace(*p); p++);
+
+	for (name = p; isalnum(*p) || *p == '_'; p++);
+	if (p == name || isdigit(*name) || *p != '=') {
+	    if (E->log != NULL)
+		fprintf(E->log, "%s: ignoring \"%s\"\n", file, name);
+	    continue;
+	}
+	*p++ = '\0';
+
+	import_value(E, p, value, sizeof(value));
+	if (E->debug)
+	    fprintf(E->log, "[%s=%s]\n", name, value);
+
+	pathflush(E, name, TRUE);
+	if (auto_prune_paths(E) && strlen(name) >= 4 &&
+	    strcmp(name + strlen(name) - 4, "PATH") == 0)
+	    editenv(E, OP_REPLACE, prune(E, name, value));
+	else
+	    editenv(E, OP_REPLACE, mkbind(E, name, value));
+    }
+
+    (void) fclose(stream);
+}
+
+/*
+ *	Import the files matching pattern (like /etc/environment, systemd's
+ *	environment.d/\*.conf, or .env files) in alphabetical order.
+ */
+static void
+import(struct esh *E, const char *pattern)
+{
+    char **files;
+    glob_t g;
+    int i, n = 0;
+
+    depend_file(E, pattern);
+
+    /* Copied, so that glob()'s memory isn't held (and can't leak) while
+     * the files are being read.
+     */
+    if (glob(pattern, 0, NULL, &g) == 0)
+	n = g.gl_pathc;
+    files = xalloc(E, NULL, (n + 1) * sizeof(char *));
+    for (i = 0; i < n; i++)
+	files[i] = newstr(E, g.gl_pathv[i]);
+    files[n] = NULL;
+    if (n > 0)
+	globfree(&g);
+
+    if (n == 0 && E->debug)
+	fprintf(E->log, "# Nothing to import from %s\n", pattern);
+    for (i = 0; i < n; i++) {
+	import_file(E, files[i]);
+	xfree(E, files[i]);
+    }
+    xfree(E, files);
+}
+
+/*
+ *	Modules.  A "use name[/version] ..." line reads the environment file
+ *	of each of the named modules from the directories in ESH_MODULEPATH,
+ *	where a module is either a file <dir>/<name> or a directory
+ *	<dir>/<name> of files named by version.  Without a version, the one
+ *	that a "default" link points to is used, or else the highest one;
+ *	a partial version like "12" picks the highest 12.x.  A module file
+ *	may start with
+ *
+ *	    #%requires other[/version] ...
+ *	    #%conflicts other[/version] ...
+ *
+ *	Rather than looking through the directories every time, what's in
+ *	them is kept in an index file that is rebuilt only when one of them
+ *	has changed, so that using a module just costs a look in the index,
+ *	a stat of its directory, and a read of its file.
+ */
+
+struct module {
+    char *name;
+    char *version;			/* "" if there's just the one */
+    char *file;
+    char *requires;			/* space separated */
+    char *conflicts;
+    unsigned long long stamp;		/* of the directory the file is in */
+    int dir;				/* in ESH_MODULEPATH */
+    int isdefault;
+};
+
+/*
+ *	Something that changes whenever the contents of dir do (0 if it
+ *	doesn't exist).
+ */
+static unsigned long long
+dir_stamp(const char *dir)
+{
+    unsigned long long h = HASH_INIT;
+    struct stat st;
+
+    if (stat(dir, &st) < 0)
+	return 0;
+    h = hash(h, &st.st_dev, sizeof(st.st_dev));
+    h = hash(h, &st.st_ino, sizeof(st.st_ino));
+    h = hash_time(h, &st.st_mtim);
+    h = hash_time(h, &st.st_ctim);
+    return h;
+}
+
+/*
+ *	The stamp of the directory that file is in.
+ */
+static unsigned long long
+file_dir_stamp(const char *file)
+{
+    char dir[MAXPATHLEN];
+    const char *slash = strrchr(file, '/');
+
+    if (slash == NULL)
+	return dir_stamp(".");
+    snprintf(dir, sizeof(dir), "%.*s", (int) MAX(slash - file, 1), file);
+    return dir_stamp(dir);
+}
+
+/*
+ *	Add a module version to the index, with what its file says it
+ *	requires and conflicts with (unless they're already known).
+ */
+static void
+module_add(struct esh *E, const char *name, const char *version,
+	   const char *file, const char *requires, const char *conflicts,
+	   unsigned long long stamp, int dir, int isdefault)
+{
+    char line[BIGBUFSIZ], req[BIGBUFSIZ], con[BIGBUFSIZ], *list, *p;
+    struct module *m;
+    FILE *fp;
+
+    if (requires == NULL) {
+	if ((fp = fopen(file, "r")) == NULL)
+	    return;
+	*req = *con = '\0';
+	while (fgets(line, sizeof(line), fp) != NULL) {
+	    if (strncmp(line, "#%requires", 10) == 0)
+		list = req, p = line + 10;
+	    else if (strncmp(line, "#%conflicts", 11) == 0)
+		list = con, p = line + 11;
+	    else
+		continue;
+	    for (; *p != '\0' && isspace(*p); p++);
+	    p[strcspn(p, "\n")] = '\0';
+	    snprintf(list + strlen(list), sizeof(req) - strlen(list), "%s%s",
+		     *list != '\0' ? " " : "", p);
+	}
+	(void) fclose(fp);
+
+	/* Tabs would get in the way of the index */
+	for (p = req; (p = strchr(p, '\t')) != NULL; )
+	    *p = ' ';
+	for (p = con; (p = strchr(p, '\t')) != NULL; )
+	    *p = ' ';
+	requires = req;
+	conflicts = con;
+    }
+
+    E->modules = xalloc(E, E->modules,
+			(E->nmodules + 1) * sizeof(struct module));
+    m = &E->modules[E->nmodules++];
+    m->name = newstr(E, name);
+    m->version = newstr(E, version);
+    m->file = newstr(E, file);
+    m->requires = newstr(E, requires);
+    m->conflicts = newstr(E, conflicts);
+    m->stamp = stamp;
+    m->dir = dir;
+    m->isdefault = isdefault;
+}
+
+/*
+ *	Look through the directories in path for modules and save what was
+ *	found in index.
+ */
+static void
+modules_build(struct esh *E, const char *path, const char *index)
+{
+    char dir[MAXPATHLEN], sub[MAXPATHLEN + 256], file[MAXPATHLEN + 512];
+    char def[MAXPATHLEN], tmp[MAXPATHLEN + 48], *slash;
+    struct dirent *de, *ve;
+    struct module *m;
+    struct stat st;
+    const char *p;
+    DIR *dd, *vd;
+    FILE *stream;
+    int i, n, fd;
+
+    if (E->debug)
+	fprintf(E->log, "# Indexing the modules in %s\n", path);
+
+    /* (Their strings stay, in case somebody still has a copy) */
+    xfree(E, E->modules);
+    E->modules = NULL;
+    E->nmodules = 0;
+
+    for (i = 0, p = path; ; i++, p++) {
+	snprintf(dir, sizeof(dir), "%.*s", (int) strcspn(p, ":"), p);
+	p += strcspn(p, ":");
+	if (*dir != '\0' && (dd = opendir(dir)) != NULL) {
+	    while ((de = readdir(dd)) != NULL) {
+		if (*de->d_name == '.')
+		    continue;
+		snprintf(sub, sizeof(sub), "%s/%s", dir, de->d_name);
+		if (stat(sub, &st) < 0)
+		    continue;
+		if (S_ISREG(st.st_mode)) {
+		    module_add(E, de->d_name, "", sub, NULL, NULL,
+			       dir_stamp(dir), i, TRUE);
+		    continue;
+		}
+		if (!S_ISDIR(st.st_mode) || (vd = opendir(sub)) == NULL)
+		    continue;
+
+		snprintf(file, sizeof(file), "%s/default", sub);
+		if ((n = readlink(file, def, sizeof(def) - 1)) < 0)
+		    n = 0;
+		def[n] = '\0';
+		slash = strrchr(def, '/');
+		while ((ve = readdir(vd)) != NULL) {
+		    if (*ve->d_name == '.' || strcmp(ve->d_name, "default") == 0)
+			continue;
+		    snprintf(file, sizeof(file), "%s/%s", sub, ve->d_name);
+		    if (stat(file, &st) == 0 && S_ISREG(st.st_mode))
+			module_add(E, de->d_name, ve->d_name, file, NULL, NULL,
+				   dir_stamp(sub), i,
+				   strcmp(slash != NULL ? slash + 1 : def,
+					  ve->d_name) == 0);
+		}
+		(void) closedir(vd);
+	    }
+	    (void) closedir(dd);
+	}
+	if (*p == '\0')
+	    break;
+    }
+
+    /* Save it for next time, if there's a place for it */
+    snprintf(tmp, sizeof(tmp), "%s", index);
+    if ((slash = strrchr(tmp, '/')) != NULL) {
+	*slash = '\0';
+	if (makedir(tmp) < 0)
+	    return;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.%d.%p", index, (int) getpid(), (void *) E);
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0)
+	return;
+    if ((stream = fdopen(fd, "w")) == NULL) {
+	(void) close(fd);
+	(void) unlink(tmp);
+	return;
+    }
+
+    fprintf(stream, "%s", MODULES_MAGIC);
+    for (p = path; ; p++) {
+	snprintf(dir, sizeof(dir), "%.*s", (int) strcspn(p, ":"), p);
+	fprintf(stream, "D\t%016llx\t%s\n", dir_stamp(dir), dir);
+	p += strcspn(p, ":");
+	if (*p == '\0')
+	    break;
+    }
+    for (m = E->modules; m < E->modules + E->nmodules; m++)
+	fprintf(stream, "M\t%s\t%s\t%s\t%s\t%s\t%016llx\t%d\t%d\n",
+		m->name, m->version, m->file, m->requires, m->conflicts,
+		m->stamp, m->dir, m->isdefault);
+
+    if (fclose(stream) != 0 || rename(tmp, index) < 0)
+	(void) unlink(tmp);
+}
+
+/*
+ *	Get the next tab separated field of an index line.
+ */
+static char *
+module_field(char **pp)
+{
+    char *field = *pp;
+
+    *pp += strcspn(*pp, "\t\n");
+    if (**pp != '\0')
+	*(*pp)++ = '\0';
+    return field;
+}
+
+/*
+ *	Read the index, unless it's missing or any of its directories has
+ *	changed since.
+ */
+static int
+modules_read(struct esh *E, const char *index)
+{
+    char line[4 * MAXPATHLEN], *p, *f[8];
+    unsigned long long stamp;
+    FILE *fp;
+    int i, ok;
+
+    xfree(E, E->modules);
+    E->modules = NULL;
+    E->nmodules = 0;
+
+    if ((fp = fopen(index, "r")) == NULL)
+	return FALSE;
+    ok = fgets(line, sizeof(line), fp) != NULL &&
+	strcmp(line, MODULES_MAGIC) == 0;
+
+    while (ok && fgets(line, sizeof(line), fp) != NULL) {
+	p = line + 2;
+	if (strncmp(line, "D\t", 2) == 0) {
+	    stamp = strtoull(module_field(&p), NULL, 16);
+	    ok = dir_stamp(module_field(&p)) == stamp;
+	} else if (strncmp(line, "M\t", 2) == 0) {
+	    for (i = 0; i < 8; i++)
+		f[i] = module_field(&p);
+	    module_add(E, f[0], f[1], f[2], f[3], f[4],
+		       strtoull(f[5], NULL, 16), atoi(f[6]), atoi(f[7]));
+	} else {
+	    ok = FALSE;
+	}
+    }
+    (void) fclose(fp);
+
+    if (!ok)
+	E->nmodules = 0;
+    return ok;
+}
+
+/*
+ *	Make sure that the module index for the current ESH_MODULEPATH is
+ *	at hand (and rebuilt, if rebuild), and return FALSE if there's no
+ *	module path.
+ */
+static int
+modules_index(struct esh *E, int rebuild)
+{
+    const char *path = lookup(E, MODULEPATH_VAR), *p;
+    char dir[MAXPATHLEN], name[32], *index;
+
+    if (path == NULL || *path == '\0')
+	return FALSE;
+    if (!rebuild && E->modpath != NULL && strcmp(E->modpath, path) == 0)
+	return TRUE;
+
+    /* A new module anywhere in the path changes the outcome */
+    for (p = path; ; p++) {
+	snprintf(dir, sizeof(dir), "%.*s", (int) strcspn(p, ":"), p);
+	depend_file(E, dir);
+	p += strcspn(p, ":");
+	if (*p == '\0')
+	    break;
+    }
+
+    snprintf(name, sizeof(name), "modules-%016llx",
+	     hash(HASH_INIT, path, strlen(path)));
+    index = cache_path(E, name);
+    if (rebuild || !modules_read(E, index))
+	modules_build(E, path, index);
+    xfree(E, index);
+
+    xfree(E, E->modpath);
+    E->modpath = newstr(E, path);
+    return TRUE;
+}
+
+/*
+ *	Find the module that spec ("name" or "name/version") refers to.  The
+ *	first directory in ESH_MODULEPATH that has the name hides the rest.
+ */
+static struct module *
+module_find(struct esh *E, const char *spec)
+{
+    int len = strcspn(spec, "/"), vlen;
+    const char *version = spec[len] == '/' ? spec + len + 1 : NULL;
+    struct module *m, *best = NULL;
+
+    for (m = E->modules; m < E->modules + E->nmodules; m++) {
+	if (strncmp(m->name, spec, len) != 0 || m->name[len] != '\0' ||
+	    (best != NULL && m->dir != best->dir))
+	    continue;
+
+	if (version != NULL) {
+	    if (strcmp(m->version, version) == 0)
+		return m;
+	    vlen = strlen(version);
+	    if (strncmp(m->version, version, vlen) != 0 ||
+		(m->version[vlen] != '.' && m->version[vlen] != '-'))
+		continue;
+	} else if (m->isdefault) {
+	    return m;
+	}
+
+	if (best == NULL || vercmp(m->version, best->version) > 0)
+	    best = m;
+    }
+
+    return best;
+}
+
+/*
+ *	Does word ("name" or "name/version") refer to module m?
+ */
+static int
+module_is(const struct module *m, const char *word)
+{
+    int len = strcspn(word, "/");
+
+    return strncmp(m->name, word, len) == 0 && m->name[len] == '\0' &&
+	(word[len] == '\0' || strcmp(m->version, word + len + 1) == 0);
+}
+
+/*
+ *	Does any of the words in list refer to module m?
+ */
+static int
+module_listed(struct esh *E, const struct module *m, const char *list)
+{
+    char *words = newstr(E, list), *p, *q;
+    int found = FALSE;
+
+    for (p = words; !found && (q = strtok_r(p, " ", &p)) != NULL; )
+	found = module_is(m, q);
+    xfree(E, words);
+
+    return found;
+}
+
+/*
+ *	Use the module that spec refers to, after the ones it requires.
+ *	Returns FALSE if it (or a module it requires) can't be used, or if
+ *	another version of it is in use already.
+ */
+static int
+module_use(struct esh *E, const char *spec)
+{
+    int len = strcspn(spec, "/"), i, vlen, ok = TRUE;
+    const char *version;
+    struct module *found, m;
+    char *words, *p, *q;
+
+    if (!modules_index(E, FALSE)) {
+	if (E->log != NULL)
+	    fprintf(E->log, "Warning: No %s to use %s from\n",
+		    MODULEPATH_VAR, spec);
+	return FALSE;
+    }
+
+    /* The index holds as long as the module's directory hasn't changed */
+    for (i = 0; i < E->nmodules; i++)
+	if (strncmp(E->modules[i].name, spec, len) == 0 &&
+	    E->modules[i].name[len] == '\0')
+	    break;
+    if (i < E->nmodules &&
+	file_dir_stamp(E->modules[i].file) != E->modules[i].stamp)
+	modules_index(E, TRUE);
+
+    if ((found = module_find(E, spec)) == NULL) {
+	if (E->log != NULL)
+	    fprintf(E->log, "Warning: No module %s -- ignored\n", spec);
+	return FALSE;
+    }
+    m = *found;
+
+    for (i = 0; i < E->nloaded; i++) {
+	if (strcmp(E->loaded[i].name, m.name) == 0) {
+	    if (strcmp(E->loaded[i].version, m.version) == 0)
+		return TRUE;
+	    if (E->log != NULL)
+		fprintf(E->log, "Warning: Module %s/%s is already in use -- "
+			"%s ignored\n", m.name, E->loaded[i].version, spec);
+
+	    /* Still good enough if it's the version that was asked for */
+	    if (spec[len] == '\0')
+		return TRUE;
+	    version = spec + len + 1;
+	    vlen = strlen(version);
+	    return strncmp(E->loaded[i].version, version, vlen) == 0 &&
+		(E->loaded[i].version[vlen] == '\0' ||
+		 E->loaded[i].version[vlen] == '.' ||
+		 E->loaded[i].version[vlen] == '-');
+	}
+	if (module_listed(E, &E->loaded[i], m.conflicts) ||
+	    module_listed(E, &m, E->loaded[i].conflicts)) {
+	    if (E->log != NULL)
+		fprintf(E->log, "Warning: Module %s conflicts with %s%s%s -- "
+			"ignored\n", spec, E->loaded[i].name,
+			*E->loaded[i].version != '\0' ? "/" : "",
+			E->loaded[i].version);
+	    return FALSE;
+	}
+    }
+
+    if (E->moddepth >= MODULE_DEPTH) {
+	if (E->log != NULL)
+	    fprintf(E->log, "Warning: Modules nested too deep -- %s ignored\n",
+		    spec);
+	return FALSE;
+    }
+
+    if (E->debug)
+	fprintf(E->log, "# Using module %s%s%s from %s\n", m.name,
+		*m.version != '\0' ? "/" : "", m.version, m.file);
+
+    /* In use from now on, so that it can't require itself */
+    E->loaded = xalloc(E, E->loaded, (E->nloaded + 1) * sizeof(struct module));
+    E->loaded[E->nloaded++] = m;
+
+    /* A requirement that can't be met is as bad as a conflict */
+    E->moddepth++;
+    words = newstr(E, m.requires);
+    for (p = words; ok && (q = strtok_r(p, " ", &p)) != NULL; )
+	if (!(ok = module_use(E, q)) && E->log != NULL)
+	    fprintf(E->log, "Warning: Module %s requires %s -- ignored\n",
+		    spec, q);
+    xfree(E, words);
+    depend_file(E, m.file);
+
+    if (!ok) {
+	for (i = E->nloaded - 1; strcmp(E->loaded[i].name, m.name) != 0; i--)
+	    ;
+	memmove(&E->loaded[i], &E->loaded[i + 1],
+		(--E->nloaded - i) * sizeof(struct module));
+	E->moddepth--;
+	return FALSE;
+    }
+
+    (void) readenv(E, m.file);
+    E->moddepth--;
+
+    p = xalloc(E, NULL, strlen(LOADED_MODULES_VAR) + 1 + strlen(m.name) + 1 +
+	       strlen(m.version) + 1);
+    sprintf(p, "%s=%s%s%s", LOADED_MODULES_VAR, m.name,
+	    *m.version != '\0' ? "/" : "", m.version);
+    pathedit(E, OP_LIST_APPEND, p);
+    xfree(E, p);
+
+    return TRUE;
+}
+
+/*
+ *	Use the (space separated) modules.
+ */
+static void
+use(struct esh *E, const char *modules)
+{
+    char *words = newstr(E, modules), *p, *q;
+
+    for (p = words; (q = strtok_r(p, " \t", &p)) != NULL; )
+	(void) module_use(E, q);
+    xfree(E, words);
+}
+
+/*
+ *	Run cmd through /bin/sh with our environment and return its exit
+ *	status (as in system()), or -1 if it couldn't be run.  The first line
+ *	of its output ends up in out, unless out is NULL.
+ */
+static int
+run(struct esh *E, const char *cmd, char *out, int outlen)
+{
+    char *argv[] = {"sh", "-c", (char *) cmd, NULL};
+    posix_spawn_file_actions_t actions;
+    int fds[2], status, rc;
+    FILE *stream;
+    char *p;
+    pid_t pid;
+
+    /* Neither end leaks into other children (the dup2 clears it on 1) */
+    if (out != NULL && pipe2(fds, O_CLOEXEC) < 0)
+	return -1;
+
+    (void) posix_spawn_file_actions_init(&actions);
+    if (out != NULL)
+	(void) posix_spawn_file_actions_adddup2(&actions, fds[1], 1);
+    rc = posix_spawn(&pid, "/bin/sh", &actions, NULL, argv, E->env);
+    (void) posix_spawn_file_actions_destroy(&actions);
+    if (rc == 0)
+	E->forks++;
+
+    if (out != NULL) {
+	(void) close(fds[1]);
+	if (rc != 0) {
+	    (void) close(fds[0]);
+	} else if ((stream = fdopen(fds[0], "r")) == NULL) {
+	    (void) close(fds[0]);
+	    *out = '\0';
+	} else {
+	    if (fgets(out, outlen, stream) == NULL)
+		*out = '\0';
+	    if ((p = strchr(out, '\n')) != NULL)
+		*p = '\0';
+	    (void) fclose(stream);
+	}
+    }
+
+    if (rc != 0) {
+	errno = rc;
+	return -1;
+    }
+
+    while (waitpid(pid, &status, 0) < 0)
+	if (errno != EINTR)
+	    return -1;
+
+    return status;
+}
+
+/*
+ *	Single-flight command substitution.  When a burst of logins for the
+ *	same user runs the same command at the same time, only one esh (the
+ *	leader) actually runs it while the others wait on a lock file in
+ *	$XDG_RUNTIME_DIR and then reuse the result that the leader left
+ *	behind.  Should the leader die, its lock dies with it and the next
+ *	waiter in line simply runs the command itself.
+ */
+
+/*
+ *	Is the inherited binding one that's different for every session of
+ *	the same user (the tmux pane, the ssh client's port, and so on)?
+ */
+static int
+per_session(struct esh *E, const char *bind)
+{
+    char name[64];
+    int len = strcspn(bind, "=");
+
+    if (len + 3 > (int) sizeof(name) || bind != *bassoc(bind, E->inherited))
+	return FALSE;
+    sprintf(name, " %.*s ", len, bind);
+    return strstr(SHARE_SESSION_VARS, name) != NULL;
+}
+
+/*
+ *	Get the "$XDG_RUNTIME_DIR/esh-<uid>-<hash>" base name for cmd.  The
+ *	hash covers what the command gets to see, i.e. the environment and
+ *	the keywords (for the likes of [interactive]), as well, but not the
+ *	inherited variables that tell concurrent sessions apart.
+ */
+static int
+share_path(struct esh *E, const char *cmd, char *buf, int bufsiz)
+{
+    const char *dir = getvar(E, SHARE_DIR_VAR);
+    unsigned long long h;
+    char **ee;
+
+    if (dir == NULL || *dir == '\0')
+	return FALSE;
+
+    h = hash(HASH_INIT, cmd, strlen(cmd) + 1);
+    for (ee = E->env; *ee != NULL; ee++)
+	if (!per_session(E, *ee))
+	    h = hash(h, *ee, strlen(*ee) + 1);
+    for (ee = E->keywords; *ee != NULL; ee++)
+	h = hash(h, *ee, strlen(*ee) + 1);
+
+    return snprintf(buf, bufsiz, "%s/esh-%d-%016llx", dir, (int) getuid(),
+		    h) < bufsiz;
+}
+
+/*
+ *	Open and lock the lock file at path (waiting for up to polls times
+ *	SHARE_POLL_MS if it's busy).  Since a lock file is removed by whoever
+ *	holds it, the lock only counts if the file is still there afterwards.
+ */
+static int
+share_lock(const char *path, int polls)
+{
+    struct stat st, lst;
+    int fd;
+
+    for (;;) {
+	if ((fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+		       0600)) < 0)
+	    return -1;
+	while (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+	    if (errno != EWOULDBLOCK || polls-- <= 0) {
+		(void) close(fd);
+		return -1;
+	    }
+	    usleep(SHARE_POLL_MS * 1000);
+	}
+	if (fstat(fd, &st) == 0 && stat(path, &lst) == 0 &&
+	    st.st_dev == lst.st_dev && st.st_ino == lst.st_ino)
+	    return fd;
+	(void) close(fd);
+    }
+}
+
+/*
+ *	Remove the results (and idle locks) of ours that are past their
+ *	window, once per context.
+ */
+static void
+share_sweep(struct esh *E, int window)
+{
+    const char *dir = getvar(E, SHARE_DIR_VAR);
+    char prefix[32], path[MAXPATHLEN];
+    struct dirent *de;
+    struct stat st;
+    DIR *dd;
+    int len, fd;
+
+    if (E->swept || dir == NULL || (dd = opendir(dir)) == NULL)
+	return;
+    E->swept = TRUE;
+
+    len = snprintf(prefix, sizeof(prefix), "esh-%d-", (int) getuid());
+    while ((de = readdir(dd)) != NULL) {
+	if (strncmp(de->d_name, prefix, len) != 0)
+	    continue;
+	snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+	if (lstat(path, &st) < 0 || st.st_uid != getuid() ||
+	    st.st_mtime + window >= time(NULL))
+	    continue;
+
+	/* A leader may still be running a slow command under it */
+	len = strlen(path);
+	if (len > 5 && strcmp(path + len - 5, ".lock") == 0) {
+	    if ((fd = share_lock(path, 0)) >= 0) {
+		(void) unlink(path);
+		(void) close(fd);
+	    }
+	} else {
+	    (void) unlink(path);
+	}
+    }
+    (void) closedir(dd);
+}
+
+/*
+ *	Pick up a result for cmd that is less than window seconds old.
+ *	The result file holds the command and its result separated by a NUL.
+ */
+static int
+share_fetch(struct esh *E, const char *base, const char *cmd, char *dst, int dstlen,
+	    int window)
+{
+    char path[MAXPATHLEN + 8];
+    int cmdlen = strlen(cmd) + 1;
+    char buf[cmdlen + dstlen];
+    struct stat st;
+    int fd, len;
+
+    snprintf(path, sizeof(path), "%s.out", base);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+	return FALSE;
+
+    if (fstat(fd, &st) < 0 || st.st_uid != getuid() ||
+	st.st_mtime + window < time(NULL) ||
+	(len = read(fd, buf, sizeof(buf) - 1)) < cmdlen ||
+	memcmp(buf, cmd, cmdlen) != 0) {
+	(void) close(fd);
+	return FALSE;
+    }
+    (void) close(fd);
+
+    buf[len] = '\0';
+    strcpy(dst, buf + cmdlen);
+
+    if (E->debug)
+	fprintf(E->log, "# Sharing result of `%s`: %s\n", cmd, dst);
+
+    return TRUE;
+}
+
+/*
+ *	Get ready to run cmd.  Returns SHARE_HIT if a recent result was copied
+ *	into dst, SHARE_NONE if we're on our own, or else a lock descriptor
+ *	that makes us the leader and should be handed to share_end() later.
+ */
+static int
+share_begin(struct esh *E, const char *cmd, char *dst, int dstlen)
+{
+    char base[MAXPATHLEN], path[MAXPATHLEN + 8];
+    int window = envnum(E, SHARE_WINDOW_VAR, SHARE_WINDOW_DEF);
+    int polls = envnum(E, SHARE_TIMEOUT_VAR, SHARE_TIMEOUT_DEF) *
+	1000 / SHARE_POLL_MS;
+    int fd;
+
+    if (window <= 0 || !share_path(E, cmd, base, sizeof(base)))
+	return SHARE_NONE;
+    share_sweep(E, window);
+
+    /* Wait for any current leader to finish (or die) */
+    snprintf(path, sizeof(path), "%s.lock", base);
+    if ((fd = share_lock(path, polls)) < 0) {
+	if (E->debug)
+	    fprintf(E->log, "# Gave up waiting for `%s`\n", cmd);
+	return SHARE_NONE;
+    }
+
+    if (share_fetch(E, base, cmd, dst, dstlen, window)) {
+	(void) unlink(path);
+	(void) close(fd);
+	return SHARE_HIT;
+    }
+
+    return fd;
+}
+
+/*
+ *	Publish the result of cmd (unless NULL) and let the waiters at it.
+ *	The lock file goes too (while we still hold it): anybody still
+ *	waiting on it will notice that it's gone and lock a new one, and
+ *	then find the result, as will anybody that comes along later.
+ */
+static void
+share_end(struct esh *E, int share, const char *cmd, const char *result)
+{
+    char base[MAXPATHLEN], tmp[MAXPATHLEN + 32], path[MAXPATHLEN + 8];
+    int fd;
+
+    if (share < 0)
+	return;
+
+    if (result != NULL && share_path(E, cmd, base, sizeof(base))) {
+	snprintf(tmp, sizeof(tmp), "%s.%d.%p", base, (int) getpid(),
+		 (void *) E);
+	snprintf(path, sizeof(path), "%s.out", base);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd >= 0) {
+	    int ok = write(fd, cmd, strlen(cmd) + 1) >= 0 &&
+		write(fd, result, strlen(result)) >= 0;
+
+	    if (close(fd) == 0 && ok)
+		(void) rename(tmp, path);
+	    else
+		(void) unlink(tmp);
+	}
+
+	snprintf(path, sizeof(path), "%s.lock", base);
+	(void) unlink(path);
+    }
+
+    /* Closing the descriptor drops the lock */
+    (void) close(share);
+}
+
+/*
+ *	A version of assoc(iate) for foo=bar type bindings.
+ *	Eg. bassoc("foo", {"abc=def", "foo=bar", NULL}) => {"foo=bar", ...}
+ *	    bassoc("foo=xyz", {"abc=def", "foo=bar", NULL}) => {"foo=bar", ...}
+ *	    bassoc("baz", {"abc=def", "foo=bar", NULL}) => {NULL}
+ */
+static char **
+bassoc(const char *key, char **env)
+{
+    register char **ee;
+    register const char *p, *q;
+
+    for (ee = env; *ee != NULL; ee++) {
+	for (p = key, q = *ee; *p == *q; p++, q++)
+	    if (*p == '\0' || *p == '=')
+		break;
+	if ((*p == '\0' || *p == '=') && (*q == '\0' || *q == '='))
+	    break;
+    }
+
+    return ee;
+}
+
+/*
+ *	Remember that the environment files have bound (or unbound) the
+ *	variable, so that the snapshot will say what it ended up as even
+ *	if that's no different from what it inherited this time.
+ */
+static void
+snapshot_bound(struct esh *E, const char *binding)
+{
+    int len = strcspn(binding, "="), i;
+
+    for (i = E->nbound - 1; i >= 0; i--)
+	if (strncmp(E->bound[i], binding, len) == 0 && E->bound[i][len] == '\0')
+	    return;
+
+    E->bound = xalloc(E, E->bound, (E->nbound + 2) * sizeof(char *));
+    E->bound[E->nbound] = xalloc(E, NULL, len + 1);
+    memcpy(E->bound[E->nbound], binding, len);
+    E->bound[E->nbound++][len] = '\0';
+    E->bound[E->nbound] = NULL;
+}
+
+/*
+ * Edit our environment by defaulting, replacing, removing, or appending
+ * the given binding (which should be of the form "var=val").
+ */
+static void
+editenv(struct esh *E, enum editop op, const char *binding)
+{
+    int envuse = E->envend - E->env;
+    
+    if (E->recording && op != OP_APPEND)
+	snapshot_bound(E, binding);
+
+    if (op != OP_APPEND) {
+	char **ee = bassoc(binding, E->env);
+	if (*ee != NULL) {
+	    switch (op) {
+		/* Only add the binding if the var is unbound */
+	      case OP_DEFAULT:
+		return;
+	      case OP_REPLACE:
+		/* Replace old binding */
+		*ee = (char *) binding;
+		return;
+	      case OP_REMOVE:
+		/* Remove existing binding */
+		for (; *ee != NULL; ee++) {
+		    ee[0] = ee[1];
+		}
+		E->envend--;
+		return;
+	      case OP_APPEND:
+	      case OP_KEYWORD:
+	      case OP_LIST_APPEND:
+	      case OP_LIST_PREPEND:
+	      case OP_LIST_REMOVE:
+		/* To keep the compiler happy... */
+		break;
+	    }
+	} else if (op == OP_REMOVE) {
+	    /* Nothing to remove */
+	    return;
+	}
+    }
+
+    /* Append the new binding */
+    if (envuse == E->envsiz) {
+	E->envsiz += ENVGROWTH;
+	E->env = xalloc(E, E->env, sizeof(char *) * (E->envsiz + 1));
+	E->envend = E->env + envuse;
+    }
+    
+    *E->envend++ = (char *) binding;
+    *E->envend = NULL;
+}
+
+/*
+ *	Rearrange the environment so that the variables matching any of the
+ *	(space, comma, or colon separated) patterns in hot come first, in
+ *	that order, since getenv() has to scan its way past everything in
+ *	front of them.  Variables without a value are dropped altogether.
+ */
+static void
+layout(struct esh *E, const char *hot)
+{
+    int n = E->envend - E->env;
+    char **old = xalloc(E, NULL, (n + 1) * sizeof(char *));
+    char **ee, **dst = E->env, pat[256];
+    const char *p, *q;
+    int len;
+
+    memcpy(old, E->env, (n + 1) * sizeof(char *));
+
+    for (p = hot; p != NULL && *p != '\0'; p = q) {
+	p += strspn(p, " \t,:");
+	q = p + strcspn(p, " \t,:");
+	if ((len = q - p) == 0 || len + 3 > (int) sizeof(pat))
+	    continue;
+
+	/* Match the name and nothing but the name */
+	sprintf(pat, "%.*s=*", len, p);
+	for (ee = old; ee < old + n; ee++) {
+	    if (*ee != NULL && matches(pat, *ee)) {
+		*dst++ = *ee;
+		*ee = NULL;
+	    }
+	}
+    }
+
+    for (ee = old; ee < old + n; ee++)
+	if (*ee != NULL)
+	    *dst++ = *ee;
+    *dst = NULL;
+
+    /* Drop the empty ones */
+    for (ee = dst = E->env; *ee != NULL; ee++) {
+	const char *eq = strchr(*ee, '=');
+
+	if (eq != NULL && eq[1] != '\0')
+	    *dst++ = *ee;
+	else if (E->debug)
+	    fprintf(E->log, "# Dropping empty %s\n", *ee);
+    }
+    *dst = NULL;
+    E->envend = dst;
+
+    xfree(E, old);
+}
+
+/*
+ *	List the bindings that differ from the old environment, followed by
+ *	the names of any variables that have been removed (in a malloc'ed,
+ *	NULL terminated array).  Our run count doesn't count.
+ */
+static char **
+envchanges(struct esh *E, char **old)
+{
+    char **changes, **cc, **ee;
+    int n = 0;
+
+    for (ee = E->env; *ee != NULL; ee++)
+	n++;
+    for (ee = old; *ee != NULL; ee++)
+	n++;
+    cc = changes = xalloc(E, NULL, (n + 1) * sizeof(char *));
+
+    for (ee = E->env; *ee != NULL; ee++) {
+	const char *prev = *bassoc(*ee, old);
+
+	if (strncmp(*ee, RUN_COUNT_VAR "=", sizeof(RUN_COUNT_VAR)) == 0 ||
+	    (prev != NULL && strcmp(prev, *ee) == 0))
+	    continue;
+	*cc++ = *ee;
+    }
+
+    for (ee = old; *ee != NULL; ee++) {
+	if (*bassoc(*ee, E->env) == NULL) {
+	    int len = strcspn(*ee, "=");
+	    *cc = xalloc(E, NULL, len + 1);
+	    memcpy(*cc, *ee, len);
+	    (*cc++)[len] = '\0';
+	}
+    }
+    *cc = NULL;
+
+    return changes;
+}
+
+/*
+ *	Path list editing.  The +=, =+, and -= operators treat a variable as
+ *	a colon separated list of unique components.  While the environment
+ *	files are being read, each such list is kept as a linked list with a
+ *	hash table on the side so that every edit only costs as much as the
+ *	components it touches.  The list is turned back into a string when
+ *	somebody needs the value (see lookup() and pathflush()).
+ */
+
+struct pathelem {
+    struct pathelem *next, *prev;	/* in path order */
+    struct pathelem *chain;		/* in hash bucket */
+    unsigned long long hash;
+    int len;
+    char dir[1];
+};
+
+struct pathlist {
+    struct pathlist *next;
+    char *name;
+    struct pathelem *head, *tail, **table;
+    int tabsiz, count;
+    long length;			/* of all components plus colons */
+    int dirty;				/* environment value is stale */
+    int bound;				/* variable exists */
+    int empties;			/* keep every empty component */
+};
+
+/*
+ *	Find the hash chain link that points to dir (or to the end of chain).
+ */
+static struct pathelem **
+path_find(struct pathlist *pl, const char *dir, int len, unsigned long long h)
+{
+    struct pathelem **pp = &pl->table[h & (pl->tabsiz - 1)];
+
+    for (; *pp != NULL; pp = &(*pp)->chain)
+	if ((*pp)->hash == h && (*pp)->len == len &&
+	    memcmp((*pp)->dir, dir, len) == 0)
+	    break;
+
+    return pp;
+}
+
+static void
+path_link(struct pathlist *pl, struct pathelem *pe, int front)
+{
+    if (front) {
+	pe->prev = NULL;
+	pe->next = pl->head;
+	if (pl->head != NULL)
+	    pl->head->prev = pe;
+	else
+	    pl->tail = pe;
+	pl->head = pe;
+    } else {
+	pe->next = NULL;
+	pe->prev = pl->tail;
+	if (pl->tail != NULL)
+	    pl->tail->next = pe;
+	else
+	    pl->head = pe;
+	pl->tail = pe;
+    }
+}
+
+static void
+path_unlink(struct pathlist *pl, struct pathelem *pe)
+{
+    if (pe->prev != NULL)
+	pe->prev->next = pe->next;
+    else
+	pl->head = pe->next;
+    if (pe->next != NULL)
+	pe->next->prev = pe->prev;
+    else
+	pl->tail = pe->prev;
+}
+
+/*
+ *	Double the hash table size when it gets crowded.
+ */
+static void
+path_rehash(struct esh *E, struct pathlist *pl)
+{
+    struct pathelem *pe;
+
+    pl->tabsiz = pl->tabsiz == 0 ? 16 : pl->tabsiz * 2;
+    xfree(E, pl->table);
+    pl->table = xalloc(E, NULL, pl->tabsiz * sizeof(struct pathelem *));
+    memset(pl->table, 0, pl->tabsiz * sizeof(struct pathelem *));
+
+    for (pe = pl->head; pe != NULL; pe = pe->next) {
+	struct pathelem **pp = &pl->table[pe->hash & (pl->tabsiz - 1)];
+	pe->chain = *pp;
+	*pp = pe;
+    }
+}
+
+/*
+ *	Add dir to the end (or front) of the list unless it's already there
+ *	(or it's empty and the list keeps all of those).  Prepending an
+ *	existing dir moves it to the front.
+ */
+static void
+path_add(struct esh *E, struct pathlist *pl, const char *dir, int len, int front)
+{
+    unsigned long long h = hash(HASH_INIT, dir, len);
+    struct pathelem **pp = path_find(pl, dir, len, h), *pe = *pp;
+
+    if (len == 0 && pl->empties)
+	pe = NULL;
+    if (pe != NULL) {
+	if (!front || pe == pl->head)
+	    return;
+	path_unlink(pl, pe);
+    } else {
+	if (pl->count >= pl->tabsiz) {
+	    path_rehash(E, pl);
+	    pp = path_find(pl, dir, len, h);
+	}
+	pe = xalloc(E, NULL, sizeof(struct pathelem) + len);
+	memcpy(pe->dir, dir, len);
+	pe->dir[len] = '\0';
+	pe->len = len;
+	pe->hash = h;
+	pe->chain = NULL;
+	*pp = pe;
+	pl->count++;
+	pl->length += len + 1;
+    }
+
+    path_link(pl, pe, front);
+    pl->bound = TRUE;
+}
+
+static void
+path_remove(struct esh *E, struct pathlist *pl, const char *dir, int len)
+{
+    struct pathelem **pp, *pe;
+
+    pp = path_find(pl, dir, len, hash(HASH_INIT, dir, len));
+    if ((pe = *pp) == NULL)
+	return;
+
+    *pp = pe->chain;
+    path_unlink(pl, pe);
+    pl->count--;
+    pl->length -= len + 1;
+    xfree(E, pe);
+}
+
+/*
+ *	Get the path list for the variable named in binding ("name=...").
+ *	A new list starts out with the current value of the variable, empty
+ *	components (i.e. the current directory) and all, unless
+ *	PPATH_REMOVE_EMPTY_SUBPATHS is set.
+ */
+static struct pathlist *
+path_list(struct esh *E, const char *binding)
+{
+    struct pathlist *pl;
+    int namelen = strcspn(binding, "="), noempty;
+    char *value, *p, *q;
+
+    for (pl = E->paths; pl != NULL; pl = pl->next)
+	if (strncmp(pl->name, binding, namelen) == 0 &&
+	    pl->name[namelen] == '\0')
+	    return pl;
+
+    pl = xalloc(E, NULL, sizeof(struct pathlist));
+    memset(pl, 0, sizeof(struct pathlist));
+    pl->name = xalloc(E, NULL, namelen + 1);
+    memcpy(pl->name, binding, namelen);
+    pl->name[namelen] = '\0';
+    pl->next = E->paths;
+    E->paths = pl;
+    path_rehash(E, pl);
+
+    depend(E, pl->name);
+    depend(E, PPATH_EMPTY_VAR);
+    noempty = getvar(E, PPATH_EMPTY_VAR) != NULL;
+    pl->empties = !noempty;
+    if ((value = getvar(E, pl->name)) != NULL) {
+	pl->bound = TRUE;
+	for (p = value; ; p = q + 1) {
+	    q = p + strcspn(p, ":");
+	    if (q > p || !noempty)
+		path_add(E, pl, p, q - p, FALSE);
+	    if (*q == '\0')
+		break;
+	}
+    }
+
+    return pl;
+}
+
+/*
+ *	Append, prepend, or remove the colon separated components in
+ *	binding ("name=dir1:dir2:...") to or from the named path list.
+ *	Empty components are ignored.
+ */
+static void
+pathedit(struct esh *E, enum editop op, const char *binding)
+{
+    struct pathlist *pl = path_list(E, binding);
+    const char *value = strchr(binding, '=');
+    const char *p, *q;
+
+    value = value == NULL ? "" : value + 1;
+
+    if (op == OP_LIST_PREPEND) {
+	/* Work backwards so that the first component ends up first */
+	for (q = value + strlen(value); q > value; q = p) {
+	    for (p = q; p > value && p[-1] != ':'; p--);
+	    if (q > p)
+		path_add(E, pl, p, q - p, TRUE);
+	    if (p > value)
+		p--;
+	}
+    } else {
+	for (p = value; *p != '\0'; p = *q == '\0' ? q : q + 1) {
+	    q = p + strcspn(p, ":");
+	    if (q == p)
+		continue;
+	    if (op == OP_LIST_APPEND)
+		path_add(E, pl, p, q - p, FALSE);
+	    else
+		path_remove(E, pl, p, q - p);
+	}
+    }
+
+    pl->dirty = TRUE;
+}
+
+/*
+ *	Turn a path list back into a "name=dir1:dir2:..." binding.
+ */
+static char *
+path_bind(struct esh *E, struct pathlist *pl)
+{
+    char *bind = xalloc(E, NULL, strlen(pl->name) + 1 + pl->length + 1);
+    char *q = bind + sprintf(bind, "%s=", pl->name);
+    struct pathelem *pe;
+
+    for (pe = pl->head; pe != NULL; pe = pe->next) {
+	if (pe != pl->head)
+	    *q++ = ':';
+	memcpy(q, pe->dir, pe->len);
+	q += pe->len;
+    }
+    *q = '\0';
+
+    return bind;
+}
+
+static void
+path_clear(struct esh *E, struct pathlist *pl)
+{
+    struct pathelem *pe, *next;
+
+    for (pe = pl->head; pe != NULL; pe = next) {
+	next = pe->next;
+	xfree(E, pe);
+    }
+    xfree(E, pl->table);
+}
+
+/*
+ *	Write the named path list (or all of them, if name is NULL) back to
+ *	the environment if it has been changed and optionally forget about it.
+ *	The name may also be a binding of the form "name=...".
+ */
+static void
+pathflush(struct esh *E, const char *name, int forget)
+{
+    struct pathlist **ppl = &E->paths, *pl;
+
+    while ((pl = *ppl) != NULL) {
+	if (name != NULL &&
+	    (strncmp(pl->name, name, strlen(pl->name)) != 0 ||
+	     (name[strlen(pl->name)] != '\0' && name[strlen(pl->name)] != '='))) {
+	    ppl = &pl->next;
+	    continue;
+	}
+
+	if (pl->dirty && pl->bound) {
+	    editenv(E, OP_REPLACE, path_bind(E, pl));
+	    pl->dirty = FALSE;
+	}
+
+	if (!forget) {
+	    ppl = &pl->next;
+	    continue;
+	}
+
+	*ppl = pl->next;
+	path_clear(E, pl);
+	xfree(E, pl->name);
+	xfree(E, pl);
+    }
+}
+
+/*
+ *	Remove all duplicate directories from a path and return the result
+ *	as a "name=value" binding (like ppath(), which see).  Empty components
+ *	are dropped too if PPATH_REMOVE_EMPTY_SUBPATHS is set.
+ */
+static char *
+prune(struct esh *E, const char *name, const char *value)
+{
+    int noempty;
+    struct pathlist pl;
+    const char *p, *q;
+    char *bind;
+
+    /* A snapshot taken without it won't do once it's set */
+    depend(E, PPATH_EMPTY_VAR);
+    noempty = getvar(E, PPATH_EMPTY_VAR) != NULL;
+
+    memset(&pl, 0, sizeof(pl));
+    pl.name = (char *) name;
+    path_rehash(E, &pl);
+
+    for (p = value; ; p = q + 1) {
+	q = p + strcspn(p, ":");
+	if (q > p || !noempty)
+	    path_add(E, &pl, p, q - p, FALSE);
+	if (*q == '\0')
+	    break;
+    }
+
+    bind = path_bind(E, &pl);
+    path_clear(E, &pl);
+
+    return bind;
+}
+
+/*
+ *	Library path trimming.  The dynamic loader tries every directory in
+ *	LD_LIBRARY_PATH, in order, for every library that a program needs,
+ *	and on every exec.  So for the variables named in ESH_LIBPATH_VARS
+ *	(e.g. "LD_LIBRARY_PATH LIBRARY_PATH"), the directories that have no
+ *	shared libraries in them at all are dropped once the environment
+ *	files have been read.  With -D, the failed opens that a program
+ *	would incur before and after are reported too.
+ */
+
+struct libname {
+    unsigned long long hash;
+    int dir;				/* the first one that has it */
+    char *name;
+};
+
+/*
+ *	Is this the name of a shared library ("libfoo.so" or "libfoo.so.1")?
+ */
+static int
+is_shlib(const char *name)
+{
+    const char *so = strstr(name, ".so");
+
+    return so != NULL && so > name && (so[3] == '\0' || so[3] == '.');
+}
+
+/*
+ *	Is this a subdirectory that the dynamic loader looks for libraries in
+ *	("glibc-hwcaps", "tls", or the platform's, like "x86_64")?
+ */
+static int
+is_libsubdir(const char *name, const char *platform)
+{
+    return strcmp(name, "glibc-hwcaps") == 0 || strcmp(name, "tls") == 0 ||
+	strcmp(name, platform) == 0;
+}
+
+/*
+ *	Note that library name was found in directory dir (unless an earlier
+ *	one has it already).  Returns TRUE if it's a new one.
+ */
+static int
+libname_add(struct esh *E, struct libname **ptable, int *psize, int *pcount,
+	    const char *name, int dir)
+{
+    unsigned long long h = hash(HASH_INIT, name, strlen(name));
+    struct libname *table = *ptable, *old;
+    int i, size = *psize, mask;
+
+    if (2 * (*pcount + 1) > size) {
+	old = table;
+	*psize = size == 0 ? 256 : 2 * size;
+	*ptable = table = xalloc(E, NULL, *psize * sizeof(struct libname));
+	memset(table, 0, *psize * sizeof(struct libname));
+	mask = *psize - 1;
+	for (i = 0; i < size; i++) {
+	    unsigned long long j = old[i].hash;
+
+	    if (old[i].name == NULL)
+		continue;
+	    while (table[j & mask].name != NULL)
+		j++;
+	    table[j & mask] = old[i];
+	}
+	xfree(E, old);
+	size = *psize;
+    }
+
+    mask = size - 1;
+    for (i = h & mask; table[i].name != NULL; i = (i + 1) & mask)
+	if (table[i].hash == h && strcmp(table[i].name, name) == 0)
+	    return FALSE;
+
+    table[i].hash = h;
+    table[i].dir = dir;
+    table[i].name = newstr(E, name);
+    (*pcount)++;
+    return TRUE;
+}
+
+/*
+ *	Drop the directories without any shared libraries (or subdirectories
+ *	for them) from the value of the named variable.
+ */
+static void
+libpath(struct esh *E, const char *name)
+{
+    struct libname *table = NULL;
+    int size = 0, count = 0;
+    char *value = getvar(E, name), *result, *q, path[MAXPATHLEN];
+    const char **dirs, *p;
+    int *nlibs, *nnew, *rank;
+    int ndirs, nkept, nshadowed, i;
+    long before, after;
+    struct utsname uts;
+    struct dirent *de;
+    DIR *dir;
+
+    if (value == NULL)
+	return;
+    if (uname(&uts) < 0)
+	uts.machine[0] = '\0';
+
+    for (ndirs = 1, p = value; *p != '\0'; p++)
+	ndirs += *p == ':';
+    dirs = xalloc(E, NULL, ndirs * sizeof(char *));
+    nlibs = xalloc(E, NULL, 3 * ndirs * sizeof(int));
+    nnew = nlibs + ndirs;
+    rank = nnew + ndirs;
+    result = q = xalloc(E, NULL, strlen(name) + 1 + strlen(value) + 1);
+    q += sprintf(q, "%s=", name);
+
+    for (i = 0, p = value; i < ndirs; i++, p += strcspn(p, ":") + 1) {
+	dirs[i] = p;
+	nlibs[i] = nnew[i] = 0;
+
+	/* An empty component is the current directory */
+	snprintf(path, sizeof(path), "%.*s", (int) strcspn(p, ":"),
+		 *p == ':' || *p == '\0' ? "." : p);
+	depend_file(E, path);
+	if ((dir = opendir(path)) == NULL)
+	    continue;
+	while ((de = readdir(dir)) != NULL) {
+	    /* Libraries that only live further down still count */
+	    if (!is_shlib(de->d_name)) {
+		nlibs[i] += is_libsubdir(de->d_name, uts.machine);
+		continue;
+	    }
+	    nlibs[i]++;
+	    nnew[i] += libname_add(E, &table, &size, &count, de->d_name, i);
+	}
+	(void) closedir(dir);
+    }
+
+    /* Keep the ones with libraries, in order */
+    for (i = nkept = nshadowed = 0; i < ndirs; i++) {
+	rank[i] = nkept;
+	if (nlibs[i] == 0)
+	    continue;
+	if (nnew[i] == 0)
+	    nshadowed++;
+	if (nkept++ > 0)
+	    *q++ = ':';
+	q += sprintf(q, "%.*s", (int) strcspn(dirs[i], ":"), dirs[i]);
+    }
+
+    /* Finding each library once costs the directories before its own */
+    for (i = before = after = 0; i < size; i++) {
+	if (table[i].name == NULL)
+	    continue;
+	before += table[i].dir;
+	after += rank[table[i].dir];
+	xfree(E, table[i].name);
+    }
+
+    if (E->debug)
+	fprintf(E->log, "# %s: %d -> %d directories (%d shadowed), "
+		"%ld -> %ld failed opens to find its %d libraries, "
+		"%d -> %d for each other library\n",
+		name, ndirs, nkept, nshadowed, before, after, count,
+		ndirs, nkept);
+
+    if (nkept < ndirs)
+	editenv(E, OP_REPLACE, result);
+    else
+	xfree(E, result);
+
+    xfree(E, table);
+    xfree(E, nlibs);
+    xfree(E, dirs);
+}
+
+/*
+ *	Trim the library paths named in ESH_LIBPATH_VARS (if any).
+ */
+static void
+libpaths(struct esh *E)
+{
+    char *vars = lookup(E, LIBPATH_VARS_VAR), *p, *q;
+
+    if (vars == NULL)
+	return;
+
+    vars = newstr(E, vars);
+    for (p = vars; (q = strtok_r(p, " \t,:", &p)) != NULL; )
+	libpath(E, q);
+    xfree(E, vars);
+}
+
+/*
+ *	Built-in variables.  These describe the resources that we actually
+ *	have (taking CPU affinity and cgroup limits into account) so that
+ *	the environment files can size thread pools and the like without
+ *	running nproc and friends.  They can be used like any variable, but
+ *	are computed when first asked for, never exported, and can't be set.
+ */
+
+/*
+ *	Read a limit from a file like cpu.max ("quota period") or memory.max
+ *	("bytes"), giving -1 if there's none.
+ */
+static long long
+read_limit(const char *file)
+{
+    long long n, period;
+    FILE *fp;
+    int got;
+
+    if ((fp = fopen(file, "r")) == NULL)
+	return -1;
+    got = fscanf(fp, "%lld %lld", &n, &period);
+    (void) fclose(fp);
+
+    if (got < 1 || n < 0)
+	return -1;			/* including "max" */
+    if (got == 2 && period > 0)
+	return (n + period - 1) / period;
+    return n;
+}
+
+/*
+ *	The tightest limit in file along our cgroup (v2) and its parents,
+ *	or -1 if there's none.
+ */
+static long long
+cgroup_limit(const char *file)
+{
+    char line[MAXPATHLEN], path[MAXPATHLEN + 64], *p;
+    long long limit = -1, n;
+    FILE *fp;
+    int len;
+
+    if ((fp = fopen("/proc/self/cgroup", "r")) == NULL)
+	return -1;
+    *path = '\0';
+    while (fgets(line, sizeof(line), fp) != NULL) {
+	if (strncmp(line, "0::", 3) == 0) {
+	    line[strcspn(line, "\n")] = '\0';
+	    snprintf(path, sizeof(path), "/sys/fs/cgroup%s", line + 3);
+	    break;
+	}
+    }
+    (void) fclose(fp);
+    if (*path == '\0')
+	return -1;
+
+    for (;;) {
+	len = strlen(path);
+	snprintf(path + len, sizeof(path) - len, "/%s", file);
+	if ((n = read_limit(path)) >= 0 && (limit < 0 || n < limit))
+	    limit = n;
+	path[len] = '\0';
+	if ((p = strrchr(path, '/')) == NULL || p - path < 14)
+	    break;			/* past /sys/fs/cgroup */
+	*p = '\0';
+    }
+
+    return limit;
+}
+
+/* ESH_NCPU: the CPUs that we may run on, within the cgroup's quota */
+static long long
+builtin_ncpu(void)
+{
+    long long n = sysconf(_SC_NPROCESSORS_ONLN), quota = -1;
+#ifdef __linux__
+    long long period;
+    cpu_set_t set;
+
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+	n = CPU_COUNT(&set);
+    if ((quota = cgroup_limit("cpu.max")) < 0) {
+	/* cgroup v1 */
+	quota = read_limit("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+	period = read_limit("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+	quota = quota > 0 && period > 0 ? (quota + period - 1) / period : -1;
+    }
+#endif
+    if (quota > 0 && quota < n)
+	n = quota;
+    return MAX(n, 1);
+}
+
+/* ESH_NUMA_NODES: how many memory nodes there are */
+static long long
+builtin_numa_nodes(void)
+{
+    glob_t g;
+    long long n = 1;
+
+    if (glob("/sys/devices/system/node/node[0-9]*", GLOB_NOSORT, NULL, &g) == 0) {
+	n = g.gl_pathc;
+	globfree(&g);
+    }
+    return n;
+}
+
+/* ESH_MEM_LIMIT: the memory that we may use, in bytes */
+static long long
+builtin_mem_limit(void)
+{
+    long long n = (long long) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    long long limit;
+
+    if ((limit = cgroup_limit("memory.max")) < 0)
+	limit = read_limit("/sys/fs/cgroup/memory/memory.limit_in_bytes");
+    if (limit > 0 && (n <= 0 || limit < n))
+	n = limit;
+    return n;
+}
+
+/* ESH_L3_BYTES: the size of the last level cache (0 if unknown) */
+static long long
+builtin_l3_bytes(void)
+{
+    char file[128];
+    long long n = 0, level;
+    char unit = '\0';
+    FILE *fp;
+    int i;
+
+    for (i = 0; n == 0 && i < 8; i++) {
+	snprintf(file, sizeof(file),
+		 "/sys/devices/system/cpu/cpu0/cache/index%d/level", i);
+	if ((level = read_limit(file)) < 0)
+	    break;
+	if (level != 3)
+	    continue;
+	snprintf(file, sizeof(file),
+		 "/sys/devices/system/cpu/cpu0/cache/index%d/size", i);
+	if ((fp = fopen(file, "r")) != NULL) {
+	    if (fscanf(fp, "%lld%c", &n, &unit) < 1)
+		n = 0;
+	    (void) fclose(fp);
+	}
+	n *= unit == 'K' ? 1024 : unit == 'M' ? 1024 * 1024 : 1;
+    }
+#ifdef _SC_LEVEL3_CACHE_SIZE
+    if (n <= 0)
+	n = sysconf(_SC_LEVEL3_CACHE_SIZE);
+#endif
+    return MAX(n, 0);
+}
+
+static const struct {
+    const char *name;
+    long long (*value)(void);
+} BuiltinVars[NBUILTINVARS] = {
+    { "ESH_NCPU", builtin_ncpu },
+    { "ESH_NUMA_NODES", builtin_numa_nodes },
+    { "ESH_MEM_LIMIT", builtin_mem_limit },
+    { "ESH_L3_BYTES", builtin_l3_bytes },
+};
+
+/*
+ *	Get the value of a built-in variable (given by name or as a
+ *	"name=..." binding), or NULL if there's no such variable.
+ */
+static char *
+builtin(struct esh *E, const char *name)
+{
+    int len = strcspn(name, "="), i;
+    char num[32];
+
+    for (i = 0; i < NBUILTINVARS; i++) {
+	if (strncmp(BuiltinVars[i].name, name, len) != 0 ||
+	    BuiltinVars[i].name[len] != '\0')
+	    continue;
+	if (E->builtins[i] == NULL) {
+	    snprintf(num, sizeof(num), "%lld", BuiltinVars[i].value());
+	    E->builtins[i] = newstr(E, num);
+	    if (E->debug)
+		fprintf(E->log, "# %s=%s\n", BuiltinVars[i].name, num);
+	}
+	return E->builtins[i];
+    }
+
+    return NULL;
+}
+
+/*
+ *	Look up the current value of an environment variable.
+ */
+static char *
+lookup(struct esh *E, const char *name)
+{
+    char *value;
+
+    pathflush(E, name, FALSE);
+    depend(E, name);
+
+    if ((value = builtin(E, name)) != NULL)
+	return value;
+    return getvar(E, name);
+}
+
+/*
+ *	Get the value of a variable in our environment (cf. getenv()).
+ */
+static char *
+getvar(struct esh *E, const char *name)
+{
+    char *bind = *bassoc(name, E->env);
+    char *eq;
+
+    if (bind == NULL)
+	return NULL;
+
+    return (eq = strchr(bind, '=')) != NULL ? eq + 1 : "";
+}
+
+/*
+ *	Environment snapshots.  Unless something in the environment files
+ *	says otherwise, the outcome of reading them is saved together with a
+ *	fingerprint of everything that went into it: the files themselves,
+ *	the keywords, the options, and the inherited variables that the files
+ *	looked at.  The next time around, esh can then simply apply the saved
+ *	bindings instead of reading the files again.
+ *
+ *	Volatile bindings ("!name value") and commands that haven't been
+ *	marked as constant with a '=' prefix (as in "$(=uname -r)") rule out
+ *	a snapshot.
+ */
+
+static char *NoEnv[] = {NULL};
+
+/*
+ *	Rule out a snapshot for this run.
+ */
+static void
+nosnapshot(struct esh *E, const char *why)
+{
+    if (E->recording && E->debug)
+	fprintf(E->log, "# No snapshot because of: %s\n", why);
+
+    E->recording = FALSE;
+}
+
+/*
+ *	Note that the outcome depends on the inherited value of a variable
+ *	(given by name or as a "name=..." binding).
+ */
+static void
+depend(struct esh *E, const char *name)
+{
+    int len = strcspn(name, "=");
+    const char *kind = "";
+    char *bind, *dep, *d;
+    int i;
+
+    if (!E->recording)
+	return;
+
+    if ((bind = builtin(E, name)) != NULL) {
+	/* Recorded as "$name=hash" to be computed again */
+	kind = "$";
+    } else {
+	/* Did it come from the environment files? */
+	bind = *bassoc(name, E->env);
+	if (bind != *bassoc(name, E->inherited))
+	    return;
+    }
+
+    for (i = 0; i < E->nsnapdeps; i++) {
+	d = E->snapdeps[i] + (*E->snapdeps[i] == '$');
+	if (strncmp(d, name, len) == 0 && (d[len] == '\0' || d[len] == '='))
+	    return;
+    }
+
+    dep = xalloc(E, NULL, 1 + len + 1 + 16 + 1);
+    if (bind == NULL)
+	sprintf(dep, "%.*s", len, name);
+    else
+	sprintf(dep, "%s%.*s=%016llx", kind, len, name,
+		hash(HASH_INIT, bind, strlen(bind)));
+
+    E->snapdeps = xalloc(E, E->snapdeps, (E->nsnapdeps + 1) * sizeof(char *));
+    E->snapdeps[E->nsnapdeps++] = dep;
+}
+
+/*
+ *	Fold the identity of all the files matching pattern into a hash.
+ */
+static unsigned long long
+hash_files(struct esh *E, const char *pattern)
+{
+    unsigned long long h = HASH_INIT;
+    glob_t g;
+    size_t i;
+
+    if (glob(pattern, 0, NULL, &g) != 0)
+	return h;
+    for (i = 0; i < g.gl_pathc; i++)
+	h = hash_file(E, h, g.gl_pathv[i], FALSE);
+    globfree(&g);
+
+    return h;
+}
+
+/*
+ *	Note that the outcome depends on the files matching pattern, which is
+ *	recorded as "<pattern=hash".
+ */
+static void
+depend_file(struct esh *E, const char *pattern)
+{
+    char *dep;
+    int i;
+
+    if (!E->recording)
+	return;
+
+    dep = xalloc(E, NULL, 1 + strlen(pattern) + 1 + 16 + 1);
+    sprintf(dep, "<%s=%016llx", pattern, hash_files(E, pattern));
+    for (i = 0; i < E->nsnapdeps; i++) {
+	if (strcmp(E->snapdeps[i], dep) == 0) {
+	    xfree(E, dep);
+	    return;
+	}
+    }
+
+    E->snapdeps = xalloc(E, E->snapdeps, (E->nsnapdeps + 1) * sizeof(char *));
+    E->snapdeps[E->nsnapdeps++] = dep;
+}
+
+/*
+ *	Check if a recorded dependency still holds.
+ */
+static int
+snapshot_depends(struct esh *E, const char *dep)
+{
+    const char *bind = *bassoc(dep, E->inherited);
+    const char *eq = strchr(dep, '=');
+    char hex[17], *pattern;
+
+    if (*dep == '<') {
+	eq = strrchr(dep, '=');
+	pattern = xalloc(E, NULL, eq - dep);
+	sprintf(pattern, "%.*s", (int) (eq - dep - 1), dep + 1);
+	snprintf(hex, sizeof(hex), "%016llx", hash_files(E, pattern));
+	xfree(E, pattern);
+	return strcmp(eq + 1, hex) == 0;
+    }
+
+    if (*dep == '$')
+	bind = builtin(E, dep + 1);
+
+    if (eq == NULL || bind == NULL)
+	return eq == NULL && bind == NULL;
+
+    snprintf(hex, sizeof(hex), "%016llx", hash(HASH_INIT, bind, strlen(bind)));
+    return strcmp(eq + 1, hex) == 0;
+}
+
+/*
+ *	The files directly in the home directory (~/.environ, ~/.shell, and
+ *	~/.eshdebug) get looked at several times over, and the home directory
+ *	is often on NFS where every look is a round trip to the server, or
+ *	takes forever if the server is down.  So they are all looked up once,
+ *	relative to a single open of $HOME, and everybody shares the results.
+ *
+ *	If ESH_HOME_CACHE names a (local) directory, copies of the files are
+ *	kept there and used for as long as the originals keep the same
+ *	attributes.  If ESH_HOME_TIMEOUT is set, the lookups are done by a
+ *	child process, and if it doesn't finish in time the home directory
+ *	is left alone and the copies (if any) are used as they are.
+ */
+
+static const char *const HomeFiles[] = {
+    ".environ", ".shell", ".eshdebug", NULL
+};
+#define NHOMEFILES	(sizeof(HomeFiles) / sizeof(HomeFiles[0]) - 1)
+
+/* What a lookup found, as passed back from the child */
+struct homeprobe {
+    int error;				/* from fstatat(), or 0 */
+    struct stat lst, st;		/* without and with following links */
+    int linklen;
+    char link[MAXPATHLEN];
+};
+
+/* The header of a cached copy */
+struct homecopy {
+    unsigned long long key;
+    unsigned int mode;
+    int linklen;
+    int content;			/* the file itself follows the link */
+    char link[MAXPATHLEN];
+};
+
+struct homefile {
+    struct homefile *next;
+    char *name;				/* relative to $HOME */
+    int error;
+    mode_t mode;			/* of whatever it points to */
+    char *link;				/* symlink target (or NULL) */
+    unsigned long long key;		/* tells versions apart */
+};
+
+/*
+ *	Look up name relative to the home directory fd.
+ */
+static void
+home_stat(int fd, const char *name, struct homeprobe *pr)
+{
+    memset(pr, 0, sizeof(*pr));
+
+    if (fstatat(fd, name, &pr->lst, AT_SYMLINK_NOFOLLOW) < 0) {
+	pr->error = errno;
+	return;
+    }
+    if (S_ISLNK(pr->lst.st_mode) &&
+	(pr->linklen = readlinkat(fd, name, pr->link, sizeof(pr->link) - 1)) < 0)
+	pr->linklen = 0;
+    if (fstatat(fd, name, &pr->st, 0) < 0)
+	pr->error = errno;
+}
+
+/*
+ *	Open home and look up all the usual files.  Returns the open home.
+ */
+static int
+home_lookups(const char *home, struct homeprobe *pr)
+{
+    int fd, error, i;
+
+    fd = open(home, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    error = errno;
+    for (i = 0; i < (int) NHOMEFILES; i++) {
+	home_stat(fd, HomeFiles[i], &pr[i]);
+	if (fd < 0)
+	    pr[i].error = error;
+    }
+
+    return fd;
+}
+
+/*
+ *	Do the lookups in a child process, so that a hung home directory only
+ *	hangs the child.  Returns FALSE if it doesn't finish within timeout.
+ */
+static int
+home_child(struct esh *E, struct homeprobe *pr, int timeout)
+{
+    int fds[2], total = sizeof(*pr) * NHOMEFILES, len = 0, n;
+    struct pollfd pfd;
+    pid_t pid;
+
+    if (pipe2(fds, O_CLOEXEC) < 0)
+	pid = -1;
+    else if ((pid = fork()) < 0) {
+	(void) close(fds[0]);
+	(void) close(fds[1]);
+    }
+    if (pid < 0) {
+	/* Just have to take our chances then */
+	E->homefd = home_lookups(E->home, pr);
+	return TRUE;
+    } else if (pid == 0) {
+	/*
+	 *	Leave the lookups to a grandchild that init will reap, so
+	 *	that one stuck on the server for good (where even SIGKILL
+	 *	can't get at it) isn't left as a zombie of the shell's.
+	 */
+	(void) close(fds[0]);
+	if ((pid = fork()) != 0)
+	    _exit(pid < 0);
+	(void) home_lookups(E->home, pr);
+	_exit(write(fds[1], pr, total) != total);
+    }
+
+    (void) close(fds[1]);
+    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+	;
+    pfd.fd = fds[0];
+    pfd.events = POLLIN;
+    while (len < total) {
+	if ((n = poll(&pfd, 1, timeout * 1000)) < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    break;
+	if ((n = read(fds[0], (char *) pr + len, total - len)) < 0 &&
+	    errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    break;
+	len += n;
+    }
+    (void) close(fds[0]);
+
+    /* If it ever gets anywhere, it dies writing to the closed pipe */
+    return len == total;
+}
+
+/*
+ *	Remember what we know about a file in the home directory.
+ */
+static struct homefile *
+home_add(struct esh *E, const char *name, int error, mode_t mode,
+	 const char *link, int linklen, unsigned long long key)
+{
+    struct homefile *hf = xalloc(E, NULL, sizeof(struct homefile));
+
+    hf->name = newstr(E, name);
+    hf->error = error;
+    hf->mode = mode;
+    hf->link = NULL;
+    if (link != NULL) {
+	hf->link = memcpy(xalloc(E, NULL, linklen + 1), link, linklen);
+	hf->link[linklen] = '\0';
+    }
+    hf->key = key;
+    hf->next = E->homefiles;
+    E->homefiles = hf;
+
+    return hf;
+}
+
+/*
+ *	Remember a lookup, identified by all that would change if the file
+ *	(or whatever it points to) did.
+ */
+static struct homefile *
+home_found(struct esh *E, const char *name, const struct homeprobe *pr)
+{
+    unsigned long long key = HASH_INIT;
+
+    key = hash(key, &pr->lst.st_ino, sizeof(pr->lst.st_ino));
+    key = hash_time(key, &pr->lst.st_ctim);
+    key = hash(key, pr->link, pr->linklen);
+    key = hash(key, &pr->st.st_dev, sizeof(pr->st.st_dev));
+    key = hash(key, &pr->st.st_ino, sizeof(pr->st.st_ino));
+    key = hash(key, &pr->st.st_size, sizeof(pr->st.st_size));
+    key = hash_time(key, &pr->st.st_mtim);
+    key = hash_time(key, &pr->st.st_ctim);
+
+    return home_add(E, name, pr->error, pr->st.st_mode,
+		    S_ISLNK(pr->lst.st_mode) ? pr->link : NULL, pr->linklen,
+		    key);
+}
+
+/*
+ *	Find out how the home directory is doing and look up the usual files.
+ */
+static void
+home_probe(struct esh *E)
+{
+    struct homeprobe pr[NHOMEFILES];
+    const char *home = getvar(E, "HOME"), *cache = getvar(E, HOME_CACHE_VAR);
+    int timeout = envnum(E, HOME_TIMEOUT_VAR, 0), i;
+
+    E->homestate = HOME_NONE;
+    if (home == NULL || *home != '/')
+	return;
+    E->home = newstr(E, home);
+    if (cache != NULL && *cache == '/')
+	E->homecache = newstr(E, cache);
+
+    if (timeout <= 0)
+	E->homefd = home_lookups(E->home, pr);
+    else if (!home_child(E, pr, timeout)) {
+	if (E->log != NULL)
+	    fprintf(E->log, "esh: %s is not responding%s\n", E->home,
+		    E->homecache != NULL ? ", using cached copies" : "");
+	E->homestate = HOME_STALLED;
+	return;
+    }
+
+    E->homestate = HOME_OK;
+    for (i = 0; i < (int) NHOMEFILES; i++)
+	(void) home_found(E, HomeFiles[i], &pr[i]);
+}
+
+/*
+ *	Open home for a lookup that wasn't done up front.
+ */
+static int
+home_fd(struct esh *E)
+{
+    if (E->homefd < 0)
+	E->homefd = open(E->home, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    return E->homefd;
+}
+
+/*
+ *	Open the cached copy of name and read its header.  The stream is left
+ *	at the beginning of the file's contents (if any).
+ */
+static FILE *
+cache_open(struct esh *E, const char *name, struct homecopy *hc)
+{
+    char path[MAXPATHLEN], hdr[128];
+    FILE *stream;
+
+    if (E->homecache == NULL)
+	return NULL;
+
+    snprintf(path, sizeof(path), "%s/%s", E->homecache, name);
+    if ((stream = fopen(path, "r")) == NULL)
+	return NULL;
+
+    if (fgets(hdr, sizeof(hdr), stream) == NULL ||
+	sscanf(hdr, HOME_CACHE_MAGIC " %llx %o %d %d", &hc->key, &hc->mode,
+	       &hc->linklen, &hc->content) != 4 ||
+	hc->linklen < 0 || hc->linklen >= (int) sizeof(hc->link) ||
+	(int) fread(hc->link, 1, hc->linklen, stream) != hc->linklen) {
+	(void) fclose(stream);
+	return NULL;
+    }
+
+    return stream;
+}
+
+/*
+ *	Refresh the cached copy of hf, along with the contents of stream (if
+ *	given), which is then rewound.
+ */
+static void
+cache_save(struct esh *E, const struct homefile *hf, FILE *stream)
+{
+    char path[MAXPATHLEN], tmp[MAXPATHLEN + 48], buf[BUFSIZ];
+    int linklen = hf->link != NULL ? strlen(hf->link) : 0, ok, len, fd;
+    FILE *out;
+
+    if (E->homecache == NULL || makedir(E->homecache) < 0)
+	return;
+
+    snprintf(path, sizeof(path), "%s/%s", E->homecache, hf->name);
+    snprintf(tmp, sizeof(tmp), "%s.%d.%p", path, (int) getpid(), (void *) E);
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0)
+	return;
+    if ((out = fdopen(fd, "w")) == NULL) {
+	(void) close(fd);
+	(void) unlink(tmp);
+	return;
+    }
+
+    fprintf(out, HOME_CACHE_MAGIC " %016llx %o %d %d\n", hf->key,
+	    (unsigned int) hf->mode, linklen, stream != NULL);
+    (void) fwrite(hf->link, 1, linklen, out);
+    ok = TRUE;
+    if (stream != NULL) {
+	while ((len = fread(buf, 1, sizeof(buf), stream)) > 0)
+	    (void) fwrite(buf, 1, len, out);
+	ok = !ferror(stream);
+	rewind(stream);
+    }
+
+    if (fclose(out) != 0 || !ok || rename(tmp, path) < 0) {
+	(void) unlink(tmp);
+	return;
+    }
+
+    if (E->debug)
+	fprintf(E->log, "# Cached a copy of %s/%s\n", E->home, hf->name);
+}
+
+/*
+ *	Find what we know about path if it's directly in the home directory
+ *	(or NULL if it isn't).
+ */
+static struct homefile *
+home_lookup(struct esh *E, const char *path)
+{
+    struct homefile *hf;
+    struct homeprobe pr;
+    struct homecopy hc;
+    const char *name;
+    FILE *stream;
+    int len;
+
+    if (E->homestate == HOME_UNKNOWN)
+	home_probe(E);
+    if (E->homestate == HOME_NONE)
+	return NULL;
+
+    len = strlen(E->home);
+    if (strncmp(path, E->home, len) != 0 || path[len] != '/')
+	return NULL;
+    name = path + len + 1;
+    if (*name == '\0' || strchr(name, '/') != NULL)
+	return NULL;
+
+    for (hf = E->homefiles; hf != NULL; hf = hf->next) {
+	if (strcmp(hf->name, name) == 0)
+	    return hf;
+    }
+
+    if (E->homestate == HOME_OK) {
+	home_stat(home_fd(E), name, &pr);
+	return home_found(E, name, &pr);
+    }
+
+    /* Stalled, so all we have to go by is the cached copy */
+    if ((stream = cache_open(E, name, &hc)) == NULL)
+	return home_add(E, name, ENOENT, 0, NULL, 0, 0);
+    (void) fclose(stream);
+    return home_add(E, name, 0, hc.mode,
+		    hc.linklen > 0 ? hc.link : NULL,
+		    hc.linklen, hc.key);
+}
+
+/*
+ *	Like access(), but for paths in the home directory, from what we know.
+ */
+static int
+home_access(struct esh *E, const char *path, int mode)
+{
+    struct homefile *hf = home_lookup(E, path);
+
+    if (hf == NULL)
+	return access(path, mode);
+    if (hf->error != 0) {
+	errno = hf->error;
+	return -1;
+    }
+    if (mode == F_OK)
+	return 0;
+    if (E->homestate == HOME_OK)
+	return faccessat(home_fd(E), hf->name, mode, 0);
+
+    /* Make do with the mode of the copy */
+    if ((mode & X_OK) && (hf->mode & 0111) == 0) {
+	errno = EACCES;
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ *	Like fopen(path, "r"), but reads paths in the home directory from the
+ *	cached copy when it's still current (and refreshes it when it isn't).
+ */
+static FILE *
+home_fopen(struct esh *E, const char *path)
+{
+    struct homefile *hf = home_lookup(E, path);
+    struct homecopy hc;
+    FILE *stream;
+    int fd;
+
+    if (hf == NULL)
+	return fopen(path, "r");
+    if (hf->error != 0) {
+	errno = hf->error;
+	return NULL;
+    }
+
+    if ((stream = cache_open(E, hf->name, &hc)) != NULL) {
+	if (hc.content && (hc.key == hf->key || E->homestate != HOME_OK)) {
+	    if (E->debug)
+		fprintf(E->log, "# Using the cached copy of %s\n", path);
+	    E->hits++;
+	    return stream;
+	}
+	(void) fclose(stream);
+    }
+    if (E->homestate != HOME_OK) {
+	errno = ENOENT;
+	return NULL;
+    }
+
+    if ((fd = openat(home_fd(E), hf->name, O_RDONLY | O_CLOEXEC)) < 0)
+	return NULL;
+    if ((stream = fdopen(fd, "r")) == NULL) {
+	(void) close(fd);
+	return NULL;
+    }
+    cache_save(E, hf, stream);
+
+    return stream;
+}
+
+/*
+ *	Like readlink(), but for paths in the home directory, from what we know.
+ */
+static int
+home_readlink(struct esh *E, const char *path, char *buf, int len)
+{
+    struct homefile *hf = home_lookup(E, path);
+    struct homecopy hc;
+    FILE *stream;
+    int n;
+
+    if (hf == NULL)
+	return readlink(path, buf, len);
+    if (hf->link == NULL) {
+	errno = hf->error != 0 && hf->error != ENOENT ? hf->error : EINVAL;
+	return -1;
+    }
+
+    if (E->homestate == HOME_OK) {
+	/* Keep the link in the cache too, unless it's already there */
+	if ((stream = cache_open(E, hf->name, &hc)) != NULL)
+	    (void) fclose(stream);
+	if (stream == NULL || hc.key != hf->key)
+	    cache_save(E, hf, NULL);
+    }
+
+    if ((n = strlen(hf->link)) > len)
+	n = len;
+    memcpy(buf, hf->link, n);
+    return n;
+}
+
+/*
+ *	Fold the identity (and optionally the contents) of a file into h.
+ */
+static unsigned long long
+hash_file(struct esh *E, unsigned long long h, const char *file, int contents)
+{
+    struct homefile *hf = home_lookup(E, file);
+    struct stat st;
+    char buf[BUFSIZ];
+    FILE *stream;
+    int fd, len;
+
+    h = hash(h, file, strlen(file) + 1);
+
+    /* Go by what we already know about the ones in the home directory */
+    if (hf != NULL) {
+	if (hf->error != 0)
+	    return h;
+	h = hash(h, &hf->key, sizeof(hf->key));
+	if (contents && (stream = home_fopen(E, file)) != NULL) {
+	    while ((len = fread(buf, 1, sizeof(buf), stream)) > 0)
+		h = hash(h, buf, len);
+	    (void) fclose(stream);
+	}
+	return h;
+    }
+
+    if (lstat(file, &st) == 0) {
+	h = hash(h, &st.st_ino, sizeof(st.st_ino));
+	h = hash_time(h, &st.st_ctim);
+    }
+    if (stat(file, &st) < 0)
+	return h;
+
+    h = hash(h, &st.st_dev, sizeof(st.st_dev));
+    h = hash(h, &st.st_ino, sizeof(st.st_ino));
+    h = hash(h, &st.st_size, sizeof(st.st_size));
+    h = hash_time(h, &st.st_mtim);
+
+    if (contents && (fd = open(file, O_RDONLY | O_CLOEXEC)) >= 0) {
+	while ((len = read(fd, buf, sizeof(buf))) > 0)
+	    h = hash(h, buf, len);
+	(void) close(fd);
+    }
+
+    return h;
+}
+
+/*
+ *	Create a directory (and its parents, if needed).
+ */
+static int
+makedir(char *dir)
+{
+    char *p;
+    int rc;
+
+    if (mkdir(dir, 0700) == 0 || errno == EEXIST)
+	return 0;
+    if (errno != ENOENT || (p = strrchr(dir, '/')) == NULL || p == dir)
+	return -1;
+
+    *p = '\0';
+    rc = makedir(dir);
+    *p = '/';
+
+    return (rc == 0 && (mkdir(dir, 0700) == 0 || errno == EEXIST)) ? 0 : -1;
+}
+
+/*
+ *	Where to keep a file of ours: with the copies of the home files, if
+ *	there's a place for them, or else in $XDG_CACHE_HOME/esh if that is
+ *	set.  Otherwise it's somewhere local, since the point is not to have
+ *	to go to the home directory (which may well be on NFS): in
+ *	$XDG_RUNTIME_DIR/esh, or a directory of our own in /tmp, and only
+ *	as a last resort in ~/.cache/esh.
+ */
+static char *
+cache_path(struct esh *E, const char *name)
+{
+    const char *dir, *esh = "/esh";
+    char *path, tmp[sizeof(LOCAL_DIR) + 32];
+    struct stat st;
+
+    if ((dir = getvar(E, HOME_CACHE_VAR)) != NULL && *dir == '/') {
+	esh = "";
+    } else if (((dir = getvar(E, SNAPSHOT_DIR_VAR)) == NULL || *dir == '\0') &&
+	       ((dir = getvar(E, LOCAL_DIR_VAR)) == NULL || *dir != '/')) {
+	/* Unless somebody else got there first */
+	snprintf(tmp, sizeof(tmp), "%s/esh-%d", LOCAL_DIR, (int) getuid());
+	if ((mkdir(tmp, 0700) == 0 || errno == EEXIST) &&
+	    lstat(tmp, &st) == 0 && S_ISDIR(st.st_mode) &&
+	    st.st_uid == getuid() && (st.st_mode & 077) == 0) {
+	    dir = tmp;
+	    esh = "";
+	} else {
+	    dir = interpret(E, SNAPSHOT_DIR, FALSE);
+	}
+    }
+
+    path = xalloc(E, NULL, strlen(dir) + strlen(esh) + 1 + strlen(name) + 1);
+    sprintf(path, "%s%s/%s", dir, esh, name);
+    return path;
+}
+
+/*
+ *	Get ready to either load or record a snapshot.  The environment
+ *	files will start out from the inherited environment (or none).
+ */
+static void
+snapshot_begin(struct esh *E, char **inherited, const char *sysenv, const char *usrenv)
+{
+    char host[MAXHOSTNAMELEN + 1], name[32], **kk;
+    int reset = inherited == NULL;
+    unsigned long long h;
+
+    E->inherited = inherited != NULL ? inherited : NoEnv;
+
+    if (getvar(E, NO_SNAPSHOT_VAR) != NULL ||
+	strcmp(sysenv, "-") == 0 || strcmp(usrenv, "-") == 0)
+	return;
+
+    /*
+     *	One snapshot per host, set of environment files, and set of
+     *	keywords, so that sessions of different kinds (say, logins and
+     *	batch jobs) don't keep replacing each other's
+     */
+    if (gethostname(host, sizeof(host) - 1) < 0)
+	host[0] = '\0';
+    host[sizeof(host) - 1] = '\0';
+    h = hash(HASH_INIT, host, strlen(host) + 1);
+    h = hash(h, sysenv, strlen(sysenv) + 1);
+    h = hash(h, usrenv, strlen(usrenv) + 1);
+    h = hash(h, &reset, sizeof(reset));
+    for (kk = E->keywords; *kk != NULL; kk++)
+	h = hash(h, *kk, strlen(*kk) + 1);
+
+    snprintf(name, sizeof(name), "snap-%016llx", h);
+    xfree(E, E->snappath);
+    E->snappath = cache_path(E, name);
+
+    /* Everything else that goes into the result */
+    h = hash(HASH_INIT, SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC));
+    h = hash(h, &reset, sizeof(reset));
+    h = hash(h, &E->autoprune, sizeof(E->autoprune));
+    for (kk = E->keywords; *kk != NULL; kk++)
+	h = hash(h, *kk, strlen(*kk) + 1);
+    h = hash_file(E, h, sysenv, TRUE);
+    h = hash_file(E, h, usrenv, TRUE);
+    h = hash_file(E, h, interpret(E, USRSHELL, FALSE), FALSE);
+
+    E->snapprint = h;
+    E->recording = TRUE;
+}
+
+/*
+ *	Apply a matching snapshot (if any).  The snapshot is a sequence of
+ *	NUL terminated records, each one beginning with a type character.
+ */
+static int
+snapshot_load(struct esh *E)
+{
+    char print[20], *buf, *p, *end;
+    struct stat st;
+    int fd, len;
+
+    /* Always read the files when debugging */
+    if (!E->recording || E->debug)
+	return FALSE;
+
+    if ((fd = open(E->snappath, O_RDONLY | O_CLOEXEC)) < 0)
+	return FALSE;
+    if (fstat(fd, &st) < 0 || st.st_uid != getuid()) {
+	(void) close(fd);
+	return FALSE;
+    }
+
+    buf = xalloc(E, NULL, st.st_size + 1);
+    len = read(fd, buf, st.st_size);
+    (void) close(fd);
+
+    snprintf(print, sizeof(print), "P%016llx", E->snapprint);
+    if (len != st.st_size || len < (int) sizeof(SNAPSHOT_MAGIC) ||
+	strncmp(buf, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) - 1) != 0 ||
+	strcmp(buf + sizeof(SNAPSHOT_MAGIC) - 1, print) != 0) {
+	xfree(E, buf);
+	return FALSE;
+    }
+    buf[len] = '\0';
+    end = buf + len;
+
+    /* Make sure that we inherited the same things as last time */
+    p = buf + sizeof(SNAPSHOT_MAGIC) - 1 + strlen(print) + 1;
+    for (; p < end; p += strlen(p) + 1) {
+	if (*p == 'D' && !snapshot_depends(E, p + 1)) {
+	    if (E->debug)
+		fprintf(E->log, "# Snapshot depends on %s\n", p + 1);
+	    xfree(E, buf);
+	    return FALSE;
+	}
+    }
+
+    if (E->debug)
+	fprintf(E->log, "# Using snapshot %s\n", E->snappath);
+
+    p = buf + sizeof(SNAPSHOT_MAGIC) - 1 + strlen(print) + 1;
+    for (; p < end; p += strlen(p) + 1) {
+	switch (*p) {
+	  case 'B':
+	    editenv(E, OP_REPLACE, p + 1);
+	    break;
+	  case 'U':
+	    editenv(E, OP_REMOVE, p + 1);
+	    break;
+	  case 'S':
+	    E->snapshell = p + 1;
+	    break;
+	  case 'L':
+	    defer(E, p + 1);
+	    break;
+	}
+    }
+
+    E->recording = FALSE;
+    E->hits++;
+    return TRUE;
+}
+
+/*
+ *	Save the outcome of reading the environment files along with the
+ *	selected shell (unless NULL).
+ */
+static void
+snapshot_save(struct esh *E, const char *shell)
+{
+    char **changes, **ee, *p, tmp[MAXPATHLEN];
+    FILE *stream;
+    int i, fd;
+
+    if (!E->recording)
+	return;
+    E->recording = FALSE;
+
+    if (getvar(E, NO_SNAPSHOT_VAR) != NULL)
+	return;
+
+    p = strrchr(E->snappath, '/');
+    *p = '\0';
+    i = makedir(E->snappath);
+    *p = '/';
+
+    snprintf(tmp, sizeof(tmp), "%s.%d.%p", E->snappath, (int) getpid(),
+	     (void *) E);
+    if (i < 0 ||
+	(fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0)
+	return;
+    if ((stream = fdopen(fd, "w")) == NULL) {
+	(void) close(fd);
+	(void) unlink(tmp);
+	return;
+    }
+
+    fprintf(stream, "%sP%016llx%c", SNAPSHOT_MAGIC, E->snapprint, '\0');
+    for (i = 0; i < E->nsnapdeps; i++)
+	fprintf(stream, "D%s%c", E->snapdeps[i], '\0');
+    if (shell != NULL)
+	fprintf(stream, "S%s%c", shell, '\0');
+    for (i = 0; i < E->ndeferred; i++)
+	fprintf(stream, "L%s%c", E->deferred[i], '\0');
+
+    /* Whatever the files bound, even if it was inherited that way */
+    for (i = 0; i < E->nbound; i++) {
+	ee = bassoc(E->bound[i], E->env);
+	if (*ee != NULL)
+	    fprintf(stream, "B%s%c", *ee, '\0');
+	else
+	    fprintf(stream, "U%s%c", E->bound[i], '\0');
+    }
+
+    for (ee = changes = envchanges(E, E->inherited); *ee != NULL; ee++)
+	if (E->bound == NULL || *bassoc(*ee, E->bound) == NULL)
+	    fprintf(stream, "%c%s%c", strchr(*ee, '=') ? 'B' : 'U', *ee, '\0');
+    xfree(E, changes);
+
+    if (fclose(stream) != 0 || rename(tmp, E->snappath) < 0) {
+	(void) unlink(tmp);
+	return;
+    }
+
+    if (E->debug)
+	fprintf(E->log, "# Saved snapshot %s\n", E->snappath);
+}
+
+/*
+ *	Copy the specified string into a newly malloced space.
+ */
+static char *
+newstr(struct esh *E, const char *string)
+{
+    int count = strlen(string) + 1;
+    return memcpy(xalloc(E, NULL, count), string, count);
+}
+
+/*
+ *	Return the numeric value of an environment variable (or def if unset).
+ */
+static int
+envnum(struct esh *E, const char *var, int def)
+{
+    const char *val = getvar(E, var);
+
+    return (val != NULL && *val != '\0') ? atoi(val) : def;
+}
+
+/*
+ *	Fold len bytes of data into the (64-bit FNV-1a) hash value h.
+ */
+static unsigned long long
+hash(unsigned long long h, const void *data, long len)
+{
+    const unsigned char *p = data;
+
+    while (len-- > 0)
+	h = (h ^ *p++) * 1099511628211ULL;
+
+    return h;
+}
+
+/*
+ *	Fold a file time stamp into h, down to the nanosecond (as a file can
+ *	easily be changed more than once within a second).
+ */
+static unsigned long long
+hash_time(unsigned long long h, const struct timespec *ts)
+{
+    h = hash(h, &ts->tv_sec, sizeof(ts->tv_sec));
+    return hash(h, &ts->tv_nsec, sizeof(ts->tv_nsec));
+}
+
+/*
+ *	Attempt to (re)allocate siz bytes and fail if we can't.
+ */
+static void *
+xalloc(struct esh *E, void *mem, long siz)
+{
+    union block *old = mem != NULL ? (union block *) mem - 1 : NULL;
+    union block *b = E->alloc(old, sizeof(union block) + siz, E->arg);
+
+    if (b == NULL)
+	fail(E, "out of memory");
+
+    if (old == NULL) {
+	b->link.prev = NULL;
+	b->link.next = E->blocks;
+	if (E->blocks != NULL)
+	    E->blocks->link.prev = b;
+	E->blocks = b;
+    } else if (b != old) {
+	/* It moved, so tell the neighbors */
+	if (b->link.prev != NULL)
+	    b->link.prev->link.next = b;
+	else
+	    E->blocks = b;
+	if (b->link.next != NULL)
+	    b->link.next->link.prev = b;
+    }
+
+    return b + 1;
+}
+
+static void
+xfree(struct esh *E, void *mem)
+{
+    union block *b;
+
+    if (mem == NULL)
+	return;
+
+    b = (union block *) mem - 1;
+    if (b->link.prev != NULL)
+	b->link.prev->link.next = b->link.next;
+    else
+	E->blocks = b->link.next;
+    if (b->link.next != NULL)
+	b->link.next->link.prev = b->link.prev;
+
+    (void) E->alloc(b, 0, E->arg);
+}
+
+/*
+ *	Give up on the current public function call.
+ */
+static void
+fail(struct esh *E, const char *why)
+{
+    E->error = why;
+    longjmp(E->fail, 1);
+}
+
+static void *
+sysalloc(void *mem, size_t siz, void *arg)
+{
+    if (siz == 0) {
+	free(mem);
+	return NULL;
+    }
+
+    return realloc(mem, siz);
+}
+
+/*
+ *	The public interface (see libesh.h).  These must not call each other
+ *	since each one of them sets up its own ENTER() point.
+ */
+
+struct esh *
+esh_new(esh_alloc_t alloc, void *arg)
+{
+    const char *const *kk;
+    struct esh *E;
+
+    if (alloc == NULL)
+	alloc = sysalloc;
+    if ((E = alloc(NULL, sizeof(struct esh), arg)) == NULL)
+	return NULL;
+
+    memset(E, 0, sizeof(struct esh));
+    E->alloc = alloc;
+    E->arg = arg;
+    E->log = stderr;
+    E->inherited = NoEnv;
+    E->homefd = -1;
+
+    if (setjmp(E->fail) != 0) {
+	while (E->blocks != NULL)
+	    xfree(E, E->blocks + 1);
+	(void) alloc(E, 0, arg);
+	return NULL;
+    }
+
+    E->envsiz = ENVGROWTH;
+    E->env = E->envend = xalloc(E, NULL, sizeof(char *) * (E->envsiz + 1));
+    *E->envend = NULL;
+
+    E->keywords = xalloc(E, NULL, sizeof(char *));
+    *E->keywords = NULL;
+    E->deferred = xalloc(E, NULL, sizeof(char *));
+    *E->deferred = NULL;
+    for (kk = BuiltinKeywords; *kk != NULL; kk++)
+	add_keyword(E, *kk);
+
+    return E;
+}
+
+void
+esh_free(struct esh *E)
+{
+    int i;
+
+    if (E == NULL)
+	return;
+
+    if (E->homefd >= 0)
+	(void) close(E->homefd);
+    for (i = 0; i < E->nselectors; i++)
+	if (E->selectors[i].ok)
+	    regfree(&E->selectors[i].re);
+    while (E->blocks != NULL)
+	xfree(E, E->blocks + 1);
+    (void) E->alloc(E, 0, E->arg);
+}
+
+const char *
+esh_error(struct esh *E)
+{
+    return E->error;
+}
+
+void
+esh_counts(struct esh *E, int *forks, int *hits)
+{
+    *forks = E->forks;
+    *hits = E->hits;
+}
+
+void
+esh_setlog(struct esh *E, FILE *log, int debug)
+{
+    E->log = log;
+    E->debug = log != NULL && debug;
+}
+
+void
+esh_setprune(struct esh *E, int prune)
+{
+    E->autoprune = prune;
+}
+
+int
+esh_init_keywords(struct esh *E, const char *user)
+{
+    ENTER(E, -1);
+
+    init_keywords(E, user);
+    return 0;
+}
+
+int
+esh_keyword(struct esh *E, const char *word)
+{
+    ENTER(E, -1);
+
+    add_keyword(E, word);
+    return 0;
+}
+
+char **
+esh_keywords(struct esh *E)
+{
+    return E->keywords;
+}
+
+char **
+esh_deferred(struct esh *E)
+{
+    return E->deferred;
+}
+
+int
+esh_inherit(struct esh *E, char **env)
+{
+    char **ee;
+
+    ENTER(E, -1);
+
+    pathflush(E, NULL, TRUE);
+    E->envend = E->env;
+    *E->envend = NULL;
+
+    for (ee = env; ee != NULL && *ee != NULL; ee++)
+	editenv(E, OP_APPEND, *ee);
+    return 0;
+}
+
+char *
+esh_getenv(struct esh *E, const char *name)
+{
+    ENTER(E, NULL);
+
+    pathflush(E, name, FALSE);
+    return getvar(E, name);
+}
+
+int
+esh_setenv(struct esh *E, const char *name, const char *value)
+{
+    ENTER(E, -1);
+
+    pathflush(E, name, TRUE);
+    editenv(E, OP_REPLACE, mkbind(E, name, value));
+    return 0;
+}
+
+int
+esh_unsetenv(struct esh *E, const char *name)
+{
+    ENTER(E, -1);
+
+    pathflush(E, name, TRUE);
+    editenv(E, OP_REMOVE, name);
+    return 0;
+}
+
+char **
+esh_environ(struct esh *E)
+{
+    ENTER(E, NULL);
+
+    pathflush(E, NULL, FALSE);
+    return E->env;
+}
+
+char **
+esh_changes(struct esh *E, char **old)
+{
+    ENTER(E, NULL);
+
+    pathflush(E, NULL, FALSE);
+    return envchanges(E, old != NULL ? old : NoEnv);
+}
+
+int
+esh_layout(struct esh *E, const char *hot)
+{
+    ENTER(E, -1);
+
+    pathflush(E, NULL, TRUE);
+    layout(E, hot);
+    return 0;
+}
+
+char *
+esh_interpret(struct esh *E, const char *string)
+{
+    ENTER(E, NULL);
+
+    return interpret(E, string, FALSE);
+}
+
+int
+esh_access(struct esh *E, const char *path, int mode)
+{
+    ENTER(E, -1);
+
+    if (home_access(E, path, mode) < 0) {
+	E->error = strerror(errno);
+	return -1;
+    }
+    return 0;
+}
+
+FILE *
+esh_fopen(struct esh *E, const char *path)
+{
+    FILE *stream;
+
+    ENTER(E, NULL);
+
+    if ((stream = home_fopen(E, path)) == NULL)
+	E->error = strerror(errno);
+    return stream;
+}
+
+int
+esh_readlink(struct esh *E, const char *path, char *buf, int len)
+{
+    int n;
+
+    ENTER(E, -1);
+
+    if ((n = home_readlink(E, path, buf, len)) < 0)
+	E->error = strerror(errno);
+    return n;
+}
+
+int
+esh_readenv(struct esh *E, const char *file)
+{
+    ENTER(E, -1);
+
+    if (readenv(E, file) < 0) {
+	E->error = strerror(errno);
+	return -1;
+    }
+
+    pathflush(E, NULL, TRUE);
+    return 0;
+}
+
+int
+esh_loadenv(struct esh *E, const char *sysenv, const char *usrenv,
+	    char **inherited)
+{
+    ENTER(E, -1);
+
+    loadenv(E, sysenv != NULL ? sysenv : SYSENVFILE,
+	    usrenv != NULL ? usrenv : USRENVFILE, inherited);
+    return 0;
+}
+
+char *
+esh_snapshot_shell(struct esh *E)
+{
+    return E->snapshell;
+}
+
+int
+esh_snapshot_save(struct esh *E, const char *shell)
+{
+    ENTER(E, -1);
+
+    snapshot_save(E, shell);
+    return 0;
+}
@@ -0,0 +1,132 @@
+/**
+ **	LIBESH -- the Environmental Meta Shell as a library
+ **
+ **	Evaluates environment files the same way esh does, but in-process and
+ **	without touching the process environment, so that job schedulers,
+ **	cron replacements, container runtimes, and the like can set up a
+ **	user's environment without having to fork esh and parse its output.
+ **
+ **	All state lives in an esh context.  Contexts are independent of each
+ **	other and may be used by different threads at the same time, but a
+ **	single context must not be used by more than one thread at a time.
+ **	Everything a context allocates (including the strings and arrays
+ **	that it returns) is released by esh_free().
+ **
+ **	Functions that return an int return 0 on success and -1 on failure;
+ **	functions that return a pointer return NULL on failure.  Either way,
+ **	esh_error() then tells what went wrong.
+ **
+ **	Typical use:
+ **
+ **	    struct esh *E = esh_new(NULL, NULL);
+ **
+ **	    esh_inherit(E, env);
+ **	    esh_init_keywords(E, user);
+ **	    esh_loadenv(E, NULL, NULL, env);
+ **	    esh_unsetenv(E, "_");
+ **	    execve(path, argv, esh_environ(E));
+ **
+ **	Copyright (c) 1990-2021, Lennart Lovstrand <esh@lenlolabs.com>
+ **/
+
+#ifndef LIBESH_H
+#define LIBESH_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define ESH_VERSION	"2.1"
+#define ESH_RUN_COUNT	"ESH_RUN_COUNT"
+
+struct esh;
+
+/*
+ *	An allocator with realloc() semantics, except that a size of zero
+ *	should free mem and return NULL.  Gets the arg given to esh_new().
+ */
+typedef void *(*esh_alloc_t)(void *mem, size_t siz, void *arg);
+
+/* Create a new context (using malloc if alloc is NULL) or free it */
+struct esh *esh_new(esh_alloc_t alloc, void *arg);
+void esh_free(struct esh *E);
+
+/* What went wrong with the last call that failed */
+const char *esh_error(struct esh *E);
+
+/*
+ *	How many commands have been run, and how many results were reused
+ *	instead (from a snapshot, another esh, or a cached home file).
+ */
+void esh_counts(struct esh *E, int *forks, int *hits);
+
+/* Send warnings (and debug output, if debug) to log, or nowhere if NULL */
+void esh_setlog(struct esh *E, FILE *log, int debug);
+
+/* Prune all *PATH variables automatically (like esh -P) */
+void esh_setprune(struct esh *E, int prune);
+
+/*
+ *	Add the user, host, system, and context keywords (user NULL means
+ *	ourselves).  Call it after esh_inherit(), since [ssh] depends on the
+ *	inherited environment.
+ */
+int esh_init_keywords(struct esh *E, const char *user);
+int esh_keyword(struct esh *E, const char *word);
+char **esh_keywords(struct esh *E);
+
+/* Start out from a copy of env (NULL for an empty environment) */
+int esh_inherit(struct esh *E, char **env);
+
+/* Get, set, or remove a variable, or get all of them ("name=value") */
+char *esh_getenv(struct esh *E, const char *name);
+int esh_setenv(struct esh *E, const char *name, const char *value);
+int esh_unsetenv(struct esh *E, const char *name);
+char **esh_environ(struct esh *E);
+
+/* List the bindings that differ from old, plus the names of removed ones */
+char **esh_changes(struct esh *E, char **old);
+
+/*
+ *	Move the variables matching the (space, comma, or colon separated)
+ *	patterns in hot to the front of the environment, in that order, and
+ *	drop those that are empty.
+ */
+int esh_layout(struct esh *E, const char *hot);
+
+/* Interpret a string (with ~, $var, and $(cmd)) like an environment file */
+char *esh_interpret(struct esh *E, const char *string);
+
+/*
+ *	Like access(), fopen(path, "r"), and readlink(), except that files
+ *	directly in $HOME are looked up only once and may come from a local
+ *	copy (see ESH_HOME_CACHE and ESH_HOME_TIMEOUT in the manual).
+ */
+int esh_access(struct esh *E, const char *path, int mode);
+FILE *esh_fopen(struct esh *E, const char *path);
+int esh_readlink(struct esh *E, const char *path, char *buf, int len);
+
+/*
+ *	The "&name value" bindings that were put off until after the shell
+ *	has started, as "name=value" with the value still uninterpreted (see
+ *	esh_interpret()).  NULL terminated.
+ */
+char **esh_deferred(struct esh *E);
+
+/* Read a single environment file ("-" for stdin) */
+int esh_readenv(struct esh *E, const char *file);
+
+/*
+ *	Read the system and user environment files (the usual ones if NULL)
+ *	on top of the inherited environment (or none, if NULL), possibly by
+ *	reusing a snapshot from last time.
+ */
+int esh_loadenv(struct esh *E, const char *sysenv, const char *usrenv,
+		char **inherited);
+
+/* The shell saved along with a snapshot that was used (or NULL) */
+char *esh_snapshot_shell(struct esh *E);
+
+/* Save a snapshot of what esh_loadenv() did, with the chosen shell */
+int esh_snapshot_save(struct esh *E, const char *shell);
+
+#endif /* LIBESH_H */
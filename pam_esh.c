@@ -0,0 +1,285 @@
+/**
+ **	PAM_ESH -- PAM session module for esh
+ **
+ **	Sets up the user's environment from the system and user environment
+ **	files when a session is opened, so that sshd, login, su, cron, etc.
+ **	can hand an already prepared environment to whatever they start next
+ **	without going through esh as a login shell.  The environment files
+ **	are evaluated by a child process running as the user; its results
+ **	are passed back through a pipe and added with pam_putenv().
+ **
+ **	Usage (e.g. in /etc/pam.d/sshd):
+ **
+ **	    session optional pam_esh.so [debug] [sysenv=file] [usrenv=file]
+ **					[timeout=secs]
+ **
+ **	Since ESH_RUN_COUNT is set as well, an esh login shell that runs
+ **	later on will not evaluate the files a second time.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <grp.h>
+#include <poll.h>
+#include <pwd.h>
+#include <signal.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define PAM_SM_SESSION
+#include <security/pam_modules.h>
+#include <security/pam_ext.h>
+
+#include "libesh.h"
+
+#define RUN_COUNT_VAR	ESH_RUN_COUNT
+#define TIMEOUT_DEF	10
+
+#define FALSE		0
+#define TRUE		(!FALSE)
+
+#define PAM_ESH_EXPORT	__attribute__((visibility("default")))
+
+extern char **environ;
+
+/*
+ *	Does the PAM_TTY item belong to a terminal?  Sessions without one
+ *	(sshd running a command, cron, etc.) use a name like "ssh" or "cron".
+ */
+static int
+interactive(const char *tty)
+{
+    return tty != NULL && (strncmp(tty, "/dev/", 5) == 0 ||
+			   strncmp(tty, "tty", 3) == 0 ||
+			   strncmp(tty, "pts/", 4) == 0);
+}
+
+/*
+ *	Close every descriptor the application had open (sshd's privilege
+ *	separation sockets, say) except for stdin, stdout, stderr, and keep,
+ *	before letting the user's commands run.
+ */
+static void
+close_others(int keep)
+{
+    struct dirent *de;
+    DIR *dd;
+    long fd, max;
+
+    if ((dd = opendir("/proc/self/fd")) != NULL) {
+	while ((de = readdir(dd)) != NULL) {
+	    fd = atol(de->d_name);
+	    if (fd > 2 && fd != keep && fd != dirfd(dd))
+		(void) close(fd);
+	}
+	(void) closedir(dd);
+	return;
+    }
+
+    for (fd = 3, max = sysconf(_SC_OPEN_MAX); fd < max; fd++)
+	if (fd != keep)
+	    (void) close(fd);
+}
+
+/*
+ *	Evaluate the environment files (NULL for the default ones) as the
+ *	given user and write the resulting changes to fd as NUL terminated
+ *	"name=value" (or "name", for removals) records.  Runs in the child
+ *	and never returns.
+ */
+static void
+evaluate(pam_handle_t *pamh, struct passwd *pw, int fd, int debug,
+	 const char *sysenv, const char *usrenv)
+{
+    char **pamenv, **ee, *p, *value, path[BUFSIZ];
+    const void *tty = NULL;
+    struct esh *E;
+
+    if (geteuid() == 0) {
+	if (setgid(pw->pw_gid) < 0 ||
+	    initgroups(pw->pw_name, pw->pw_gid) < 0 ||
+	    setuid(pw->pw_uid) < 0)
+	    _exit(1);
+    } else if (getuid() != pw->pw_uid) {
+	/* Won't evaluate somebody else's files */
+	_exit(1);
+    }
+
+    /* Start from the PAM environment plus the basics of a login, so that
+     * "PATH $HOME/bin:$PATH" comes out the way it would for a login shell
+     */
+    pamenv = pam_getenvlist(pamh);
+    environ = pamenv != NULL ? pamenv : calloc(1, sizeof(char *));
+    (void) setenv("HOME", pw->pw_dir, 0);
+    (void) setenv("USER", pw->pw_name, 0);
+    (void) setenv("LOGNAME", pw->pw_name, 0);
+    (void) setenv("SHELL", pw->pw_shell, 0);
+    if (confstr(_CS_PATH, path, sizeof(path)) == 0 || path[0] == '\0')
+	strcpy(path, "/usr/bin:/bin");
+    (void) setenv("PATH", path, 0);
+    snprintf(path, sizeof(path), "/var/mail/%s", pw->pw_name);
+    (void) setenv("MAIL", path, 0);
+    if (chdir(pw->pw_dir) < 0)
+	(void) chdir("/");
+
+    /* Just like esh would have done as a login shell */
+    if ((E = esh_new(NULL, NULL)) == NULL)
+	_exit(1);
+    esh_setlog(E, stderr, debug);
+    (void) pam_get_item(pamh, PAM_TTY, &tty);
+    if (esh_inherit(E, environ) < 0 ||
+	esh_init_keywords(E, NULL) < 0 ||
+	esh_keyword(E, interactive(tty) ? "interactive" : "noninteractive") < 0 ||
+	esh_setenv(E, RUN_COUNT_VAR, "1") < 0 ||
+	esh_loadenv(E, sysenv, usrenv, environ) < 0 ||
+	esh_unsetenv(E, "_") < 0 ||
+	(ee = esh_deferred(E)) == NULL)
+	_exit(1);
+
+    /* There's no shell to hand the deferred bindings to later on */
+    for (; *ee != NULL; ee++) {
+	if ((p = strdup(*ee)) == NULL)
+	    _exit(1);
+	*strchr(p, '=') = '\0';
+	if ((value = esh_interpret(E, *ee + strlen(p) + 1)) == NULL ||
+	    esh_setenv(E, p, value) < 0)
+	    _exit(1);
+	free(p);
+    }
+
+    if ((ee = esh_changes(E, environ)) == NULL)
+	_exit(1);
+
+    for (; *ee != NULL; ee++) {
+	if (write(fd, *ee, strlen(*ee) + 1) < 0)
+	    _exit(1);
+    }
+
+    _exit(0);
+}
+
+/*
+ *	Read everything the child has to say, giving up if it stays silent
+ *	for more than timeout seconds.
+ */
+static char *
+collect(int fd, int timeout, int *plen)
+{
+    struct pollfd pfd;
+    char *buf = NULL, *nbuf;
+    int len = 0, size = 0, n;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    for (;;) {
+	if ((n = poll(&pfd, 1, timeout * 1000)) < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0) {
+	    free(buf);
+	    return NULL;
+	}
+	if (len == size) {
+	    size = size == 0 ? BUFSIZ : size * 2;
+	    if ((nbuf = realloc(buf, size)) == NULL) {
+		free(buf);
+		return NULL;
+	    }
+	    buf = nbuf;
+	}
+	if ((n = read(fd, buf + len, size - len)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    free(buf);
+	    return NULL;
+	}
+	if (n == 0)
+	    break;
+	len += n;
+    }
+
+    *plen = len;
+    return buf;
+}
+
+PAM_ESH_EXPORT int
+pam_sm_open_session(pam_handle_t *pamh, int flags, int argc, const char **argv)
+{
+    const char *user, *sysenv = NULL, *usrenv = NULL;
+    struct passwd *pw;
+    int debug = FALSE, timeout = TIMEOUT_DEF;
+    int fds[2], status = 0, len, i;
+    char *buf, *p;
+    pid_t pid, rc;
+
+    for (i = 0; i < argc; i++) {
+	if (strcmp(argv[i], "debug") == 0)
+	    debug = TRUE;
+	else if (strncmp(argv[i], "sysenv=", 7) == 0)
+	    sysenv = argv[i] + 7;
+	else if (strncmp(argv[i], "usrenv=", 7) == 0)
+	    usrenv = argv[i] + 7;
+	else if (strncmp(argv[i], "timeout=", 8) == 0)
+	    timeout = atoi(argv[i] + 8);
+	else
+	    pam_syslog(pamh, LOG_ERR, "unknown option: %s", argv[i]);
+    }
+
+    /* Already taken care of? */
+    if (pam_getenv(pamh, RUN_COUNT_VAR) != NULL)
+	return PAM_IGNORE;
+
+    if (pam_get_user(pamh, &user, NULL) != PAM_SUCCESS || user == NULL ||
+	(pw = getpwnam(user)) == NULL)
+	return PAM_SESSION_ERR;
+
+    if (pipe(fds) < 0)
+	return PAM_SESSION_ERR;
+
+    if ((pid = fork()) < 0) {
+	(void) close(fds[0]);
+	(void) close(fds[1]);
+	return PAM_SESSION_ERR;
+    } else if (pid == 0) {
+	(void) close(fds[0]);
+	close_others(fds[1]);
+	evaluate(pamh, pw, fds[1], debug, sysenv, usrenv);
+    }
+
+    (void) close(fds[1]);
+    buf = collect(fds[0], timeout, &len);
+    (void) close(fds[0]);
+
+    if (buf == NULL)
+	(void) kill(pid, SIGKILL);
+    while ((rc = waitpid(pid, &status, 0)) < 0 && errno == EINTR)
+	;
+
+    /* (The application may have reaped it for us, but then who knows) */
+    if (buf == NULL || rc < 0 || !WIFEXITED(status) ||
+	WEXITSTATUS(status) != 0) {
+	pam_syslog(pamh, LOG_ERR, "could not set up the environment of %s",
+		   user);
+	free(buf);
+	return PAM_SESSION_ERR;
+    }
+
+    for (p = buf; p < buf + len; p += strlen(p) + 1)
+	(void) pam_putenv(pamh, p);
+    (void) pam_putenv(pamh, RUN_COUNT_VAR "=1");
+
+    free(buf);
+    return PAM_SUCCESS;
+}
+
+PAM_ESH_EXPORT int
+pam_sm_close_session(pam_handle_t *pamh, int flags, int argc,
+		     const char **argv)
+{
+    return PAM_SUCCESS;
+}
@@ -48,15 +48,16 @@ char *path;
 
     colon = FALSE;
     for (pp = strings; *pp != NULL; pp++) {
-	if (remove_empty_subpaths && **pp == '\0')
-	    continue;
-	if (colon)
-	    (void) strcat(result, ":");
-	else
-	    colon = TRUE;
-	(void) strcat(result, *pp);
+	if (!remove_empty_subpaths || **pp != '\0') {
+	    if (colon)
+		(void) strcat(result, ":");
+	    else
+		colon = TRUE;
+	    (void) strcat(result, *pp);
+	}
 	(void) free(*pp);
     }
+    (void) free(strings);
 
     return result;
 }
@@ -6,6 +6,10 @@
  **	Usage: ppath foo:bar:baz:foo => foo:bar:baz
  **	as in: PATH=`ppath $PATH`
  **
+ **	It can also prune a whole stream of NAME=value records read from
+ **	stdin (-s) or every *PATH variable in its environment (--env) so
+ **	that a single process can take care of all of them.
+ **
  **	Lennart Lovstrand, Rank Xerox EuroPARC, England.
  **	Created: Thu Jan 11 10:54:23 1990
  **     Last edited: Thu May 27 17:19:14 2004
@@ -13,20 +17,83 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define TRUE		1
 #define FALSE		0
 
 extern char *ppath();
 extern int ppath_remove_empty_subpaths;
+extern char **environ;
 
 void usage(pname)
 char *pname;
 {
     fprintf(stderr, "usage: %s [-z] [-e] path\n", pname);
+    fprintf(stderr, "       %s [-z] [-0] -s\n", pname);
+    fprintf(stderr, "       %s [-z] --env\n", pname);
     exit(1);
 }
 
+/*
+ *	Read "NAME=value" records from stdin, separated by delim, and write
+ *	them back out with their values pruned.  A record without an equal
+ *	sign is taken to be a bare path.
+ */
+void
+prune_stream(delim)
+int delim;
+{
+    char *record = NULL, *value, *pruned;
+    size_t size = 0;
+    ssize_t len;
+
+    while ((len = getdelim(&record, &size, delim, stdin)) != -1) {
+	if (len > 0 && record[len - 1] == delim)
+	    record[--len] = '\0';
+
+	value = strchr(record, '=');
+	if (value == NULL) {
+	    pruned = ppath(record);
+	    fputs(pruned, stdout);
+	} else {
+	    *value++ = '\0';
+	    pruned = ppath(value);
+	    printf("%s=%s", record, pruned);
+	}
+	putchar(delim);
+	free(pruned);
+    }
+
+    free(record);
+}
+
+/*
+ *	Print a shell assignment for every *PATH variable in the environment.
+ */
+void
+prune_environ()
+{
+    char **ee, *eq, *pruned;
+    const char *p;
+
+    for (ee = environ; *ee != NULL; ee++) {
+	eq = strchr(*ee, '=');
+	if (eq == NULL || eq - *ee < 4 || strncmp(eq - 4, "PATH", 4) != 0)
+	    continue;
+
+	pruned = ppath(eq + 1);
+	printf("export %.*s='", (int) (eq - *ee), *ee);
+	for (p = pruned; *p != '\0'; p++)
+	    if (*p == '\'')
+		fputs("'\"'\"'", stdout);
+	    else
+		putchar(*p);
+	printf("'\n");
+	free(pruned);
+    }
+}
+
 int
 main(argc, argv)
 int argc;
@@ -34,14 +101,26 @@ char **argv;
 {
     int ac;
     int next_is_path = FALSE;
+    int stream = FALSE, env = FALSE;
+    int delim = '\n';
 
     for (ac = 1; ac < argc && argv[ac][0] == '-' && !next_is_path; ac++) {
 	const char *opt;
+	if (strcmp(argv[ac], "--env") == 0) {
+	    env = TRUE;
+	    continue;
+	}
 	for (opt = &argv[ac][1]; *opt != '\0'; opt++) {
 	    switch (*opt) {
+	      case '0':
+		delim = '\0';
+		break;
 	      case 'e':
 		next_is_path = TRUE;
 		break;
+	      case 's':
+		stream = TRUE;
+		break;
 	      case 'z':
 		ppath_remove_empty_subpaths = TRUE;
 		break;
@@ -52,6 +131,16 @@ char **argv;
 	}
     }
 
+    if (stream || env) {
+	if (ac != argc || (stream && env))
+	    usage(argv[0]);
+	if (stream)
+	    prune_stream(delim);
+	else
+	    prune_environ();
+	return 0;
+    }
+
     if (argc - ac != 1)
 	usage(argv[0]);
 